@@ -20,6 +20,27 @@ exports.query = function (query,
 };
 
 
+var doQueryColumns = exports.queryColumns;
+
+// Numeric and date columns are NumberColumn objects of packed doubles,
+// dates being milliseconds since the epoch; others are plain arrays
+exports.queryColumns = function (query,
+                                 queryParams/* = [] */,
+                                 by/* = [] */,
+                                 byParams/* = [] */,
+                                 start/* = 0 */,
+                                 length/* optional */) {
+  if (!arguments.length)
+    throw TypeError('At least 1 argument required');
+  return doQueryColumns(query,
+                        queryParams || [],
+                        by ? (by instanceof Array ? by : [by]) : [],
+                        byParams || [],
+                        start || 0,
+                        length);
+};
+
+
 exports.dropAll = function () {
   exports.drop(exports.list());
 };
@@ -91,6 +91,13 @@ require.main.exports.handle = function (socket) {
   var response = require.main.exports.app(request);
 
   var parts = [new Binary('HTTP/1.1 ' + response.status), crlf];
+  if (core.serverTiming) {
+    var timing = core.getRequestTiming();
+    var metrics = [];
+    for (var metric in timing)
+      metrics.push(metric + ';dur=' + timing[metric].toFixed(3));
+    parts.push(new Binary('Server-Timing: ' + metrics.join(', ')), crlf);
+  }
   for (name in response.headers) {
     var values = response.headers[name];
     if (!(values instanceof Array))
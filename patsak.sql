@@ -120,41 +120,65 @@ END;
 $$ LANGUAGE plpgsql VOLATILE;
 
 
-CREATE FUNCTION ak.describe_table(
-    name text, OUT attname name, OUT typname name, OUT def text)
+-- The whole schema in one result: a 't' row per table, an 'a' row per
+-- attribute in attnum order, and a 'c' row per primary key, unique,
+-- foreign key, or check constraint of the table with its contype.
+-- Keep in sync with patsak-upgrade.sql
+CREATE OR REPLACE FUNCTION ak.describe_schema(
+    schema_name text,
+    OUT relname name, OUT kind "char",
+    OUT attname name, OUT typname name, OUT def text,
+    OUT conkey int2[], OUT refname name, OUT confkey int2[],
+    OUT contype "char")
     RETURNS SETOF RECORD AS
 $$
-    SELECT attribute.attname, pg_type.typname, ak.eval(attribute.adsrc)
-    FROM pg_catalog.pg_type AS pg_type,
-         (pg_catalog.pg_attribute LEFT JOIN pg_catalog.pg_attrdef
-          ON pg_catalog.pg_attribute.attrelid = pg_catalog.pg_attrdef.adrelid
-          AND pg_catalog.pg_attribute.attnum = pg_catalog.pg_attrdef.adnum)
-         AS attribute
-    WHERE pg_type.oid = attribute.atttypid
-    AND attribute.attnum > 0
-    AND attribute.attrelid = $1::regclass
-    ORDER BY attribute.attnum;
-$$ LANGUAGE SQL STABLE;
-
-
-CREATE FUNCTION ak.get_schema_tables(name text, OUT relname name)
-    RETURNS SETOF name AS
-$$
-    SELECT tablename AS relname
-    FROM pg_catalog.pg_tables
-    WHERE schemaname=$1;
-$$ LANGUAGE SQL STABLE;
-
-
-CREATE FUNCTION ak.describe_constrs(
-    table_name text,
-    OUT contype "char", OUT conkey int2[], OUT relname name, OUT confkey int2[])
-    RETURNS SETOF RECORD AS
-$$
-    SELECT contype, conkey, relname, confkey
-    FROM pg_catalog.pg_constraint LEFT JOIN pg_catalog.pg_class
-    ON pg_catalog.pg_constraint.confrelid = pg_catalog.pg_class.oid
-    WHERE conrelid = $1::regclass;
+    SELECT relname, kind, attname, typname, def,
+           conkey, refname, confkey, contype
+    FROM (
+        SELECT pg_class.oid AS relid, pg_class.relname, 't'::"char" AS kind,
+               0::int2 AS num, NULL::name AS attname, NULL::name AS typname,
+               NULL::text AS def, NULL::int2[] AS conkey,
+               NULL::name AS refname, NULL::int2[] AS confkey,
+               NULL::"char" AS contype
+        FROM pg_catalog.pg_class, pg_catalog.pg_namespace
+        WHERE pg_class.relnamespace = pg_namespace.oid
+        AND pg_namespace.nspname = $1
+        AND pg_class.relkind = 'r'
+    UNION ALL
+        SELECT pg_class.oid, pg_class.relname, 'a',
+               attribute.attnum, attribute.attname, pg_type.typname,
+               ak.eval(attribute.adsrc), NULL, NULL, NULL, NULL
+        FROM pg_catalog.pg_type,
+             (pg_catalog.pg_attribute LEFT JOIN pg_catalog.pg_attrdef
+              ON pg_catalog.pg_attribute.attrelid =
+                 pg_catalog.pg_attrdef.adrelid
+              AND pg_catalog.pg_attribute.attnum = pg_catalog.pg_attrdef.adnum)
+             AS attribute,
+             pg_catalog.pg_class,
+             pg_catalog.pg_namespace
+        WHERE pg_type.oid = attribute.atttypid
+        AND attribute.attnum > 0
+        AND attribute.attrelid = pg_class.oid
+        AND pg_class.relnamespace = pg_namespace.oid
+        AND pg_namespace.nspname = $1
+        AND pg_class.relkind = 'r'
+    UNION ALL
+        SELECT pg_class.oid, pg_class.relname, 'c',
+               0, NULL, NULL, NULL,
+               pg_constraint.conkey, ref_class.relname, pg_constraint.confkey,
+               pg_constraint.contype
+        FROM (pg_catalog.pg_constraint LEFT JOIN pg_catalog.pg_class
+              AS ref_class
+              ON pg_catalog.pg_constraint.confrelid = ref_class.oid),
+             pg_catalog.pg_class,
+             pg_catalog.pg_namespace
+        WHERE pg_constraint.conrelid = pg_class.oid
+        AND pg_constraint.contype IN ('p', 'u', 'f', 'c')
+        AND pg_class.relnamespace = pg_namespace.oid
+        AND pg_namespace.nspname = $1
+        AND pg_class.relkind = 'r'
+    ) AS description
+    ORDER BY relid, num;
 $$ LANGUAGE SQL STABLE;
 
 
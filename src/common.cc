@@ -4,6 +4,10 @@
 
 #include <boost/lexical_cast.hpp>
 
+#include <iomanip>
+#include <math.h>
+#include <sstream>
+#include <stdio.h>
 #include <time.h>
 
 
@@ -256,6 +260,8 @@ public:
     virtual Type GetType() const = 0;
     virtual bool Get(double& d, string& s) const = 0;
     virtual void Print(ostream& os) const = 0;
+    virtual string GetPgText() const = 0;
+    virtual string GetPgType() const = 0;
 };
 
 
@@ -293,6 +299,27 @@ namespace
                    : lexical_cast<string>(repr_));
         }
 
+        virtual string GetPgText() const {
+            return (repr_ != repr_
+                    ? "NaN"
+                    : repr_ == numeric_limits<double>::infinity()
+                    ? "Infinity"
+                    : repr_ == -numeric_limits<double>::infinity()
+                    ? "-Infinity"
+                    : lexical_cast<string>(repr_));
+        }
+
+        // Integral numbers are int8 like integer literals,
+        // so comparisons with integer attributes can use indexes
+        virtual string GetPgType() const {
+            if (repr_ != repr_ ||
+                fabs(repr_) == numeric_limits<double>::infinity())
+                return "float8";
+            return (repr_ == floor(repr_) && fabs(repr_) < 1e15
+                    ? "int8"
+                    : "numeric");
+        }
+
     private:
         double repr_;
     };
@@ -316,6 +343,27 @@ namespace
             os << "'" << escape_cb(repr_, type_ == Type::BINARY) << "'";
         }
 
+        virtual string GetPgText() const {
+            if (type_ != Type::BINARY)
+                return repr_;
+            // bytea escape format
+            ostringstream oss;
+            oss.fill('0');
+            oss << oct;
+            BOOST_FOREACH(char c, repr_) {
+                unsigned char u = c;
+                if (u < 0x20 || u > 0x7e || u == '\\')
+                    oss << '\\' << setw(3) << static_cast<unsigned>(u);
+                else
+                    oss << c;
+            }
+            return oss.str();
+        }
+
+        virtual string GetPgType() const {
+            return type_.GetPgName();
+        }
+
     private:
         Type type_;
         string repr_;
@@ -340,12 +388,34 @@ namespace
             os << (repr_ ? "true" : "false");
         }
 
+        virtual string GetPgText() const {
+            return repr_ ? "true" : "false";
+        }
+
+        virtual string GetPgType() const {
+            return "bool";
+        }
+
 
     private:
         bool repr_;
     };
 
 
+    void ParseTimestamp(const char* str, struct tm& tm, size_t& ms)
+    {
+        const char* rest = strptime(str, "%F %T", &tm);
+        AK_ASSERT(rest);
+        tm.tm_isdst = -1;
+        ms = 0;
+        if (*rest == '.') {
+            ++rest;
+            for (size_t m = 100; *rest && m; ++rest, m /= 10)
+                ms += (*rest - '0') * m;
+        }
+    }
+
+
     class DateValue : public Value::Impl {
     public:
         DateValue(double d) {
@@ -355,15 +425,7 @@ namespace
         }
 
         DateValue(const string& s) {
-            char* rest = strptime(s.c_str(), "%F %T", &tm_);
-            AK_ASSERT(rest);
-            tm_.tm_isdst = -1;
-            ms_ = 0;
-            if (*rest == '.') {
-                ++rest;
-                for (size_t m = 100; *rest && m; ++rest, m /= 10)
-                    ms_ += (*rest - '0') * m;
-            }
+            ParseTimestamp(s.c_str(), tm_, ms_);
         }
 
         virtual Type GetType() const {
@@ -385,6 +447,19 @@ namespace
             os << buf;
         }
 
+        virtual string GetPgText() const {
+            const size_t size = 40;
+            char buf[size];
+            size_t length = strftime(buf, size, "%F %T", &tm_);
+            snprintf(buf + length, size - length, ".%03u",
+                     static_cast<unsigned>(ms_));
+            return buf;
+        }
+
+        virtual string GetPgType() const {
+            return "timestamp(3)";
+        }
+
 
     private:
         mutable struct tm tm_; // mutable for mktime
@@ -429,6 +504,15 @@ namespace
 }
 
 
+double ak::ReadPgDate(const char* str)
+{
+    struct tm tm;
+    size_t ms;
+    ParseTimestamp(str, tm, ms);
+    return static_cast<double>(mktime(&tm)) * 1000 + ms;
+}
+
+
 Value::Value(Type type, double d)
     : pimpl_(CreateValueImplByDouble(type, d))
 {
@@ -482,6 +566,68 @@ void Value::Print(ostream& os) const
     pimpl_->Print(os);
 }
 
+
+string Value::GetPgText() const
+{
+    return pimpl_->GetPgText();
+}
+
+
+string Value::GetPgType() const
+{
+    return pimpl_->GetPgType();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// GetMicroTime, GetSpanTime, and SpanTimer
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    uint64_t span_times[SPAN_COUNT];
+    Span current_span = SPAN_COUNT;
+    uint64_t current_since = 0;
+
+
+    // Charge the time since the last switch to the current span if any
+    void SwitchSpan(Span span)
+    {
+        uint64_t now = GetMicroTime();
+        if (current_span != SPAN_COUNT)
+            span_times[current_span] += now - current_since;
+        current_span = span;
+        current_since = now;
+    }
+}
+
+
+uint64_t ak::GetMicroTime()
+{
+    struct timespec ts;
+    int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+    AK_ASSERT_EQUAL(ret, 0);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+uint64_t ak::GetSpanTime(Span span)
+{
+    return span_times[span];
+}
+
+
+SpanTimer::SpanTimer(Span span)
+    : outer_span_(current_span)
+{
+    SwitchSpan(span);
+}
+
+
+SpanTimer::~SpanTimer()
+{
+    SwitchSpan(outer_span_);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // InitCommon
 ////////////////////////////////////////////////////////////////////////////////
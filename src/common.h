@@ -6,9 +6,11 @@
 #include "orset.h"
 
 #include <boost/shared_ptr.hpp>
+#include <boost/utility.hpp>
 
 #include <iostream>
 #include <stdexcept>
+#include <stdint.h>
 
 
 namespace ak
@@ -56,7 +58,7 @@ namespace ak
     };
 
     ////////////////////////////////////////////////////////////////////////////
-    // Type, Types, ReadType, and ReadPgType
+    // Type, Types, ReadType, ReadPgType, and ReadPgDate
     ////////////////////////////////////////////////////////////////////////////
 
     class Type {
@@ -102,6 +104,9 @@ namespace ak
     Type ReadType(const std::string& name);
     Type ReadPgType(const std::string& pg_name);
 
+    // Milliseconds since the epoch of a PostgreSQL timestamp text
+    double ReadPgDate(const char* str);
+
     ////////////////////////////////////////////////////////////////////////////
     // Value, Values, and ValuePtr
     ////////////////////////////////////////////////////////////////////////////
@@ -121,6 +126,10 @@ namespace ak
         bool Get(double& d, std::string& s) const;
         void Print(std::ostream& os) const;
 
+        // Text and type of the value bound as a statement parameter
+        std::string GetPgText() const;
+        std::string GetPgType() const;
+
     protected:
         boost::shared_ptr<Impl> pimpl_;
 
@@ -323,6 +332,38 @@ namespace ak
 
     const size_t MINUS_ONE = static_cast<size_t>(-1);
 
+    ////////////////////////////////////////////////////////////////////////////
+    // GetMicroTime, Span, GetSpanTime, and SpanTimer
+    ////////////////////////////////////////////////////////////////////////////
+
+    // Monotonic time in microseconds
+    uint64_t GetMicroTime();
+
+
+    // Layers the time of request handling is split between
+    enum Span {
+        TRANSLATION_SPAN,
+        DB_SPAN,
+        SOCKET_SPAN,
+        SPAN_COUNT
+    };
+
+
+    // Microseconds spent in the span by this process
+    uint64_t GetSpanTime(Span span);
+
+
+    // Charges the time of its life to the span. An inner timer suspends
+    // the outer one, so each span gets exclusive time.
+    class SpanTimer : private boost::noncopyable {
+    public:
+        SpanTimer(Span span);
+        ~SpanTimer();
+
+    private:
+        Span outer_span_;
+    };
+
     ////////////////////////////////////////////////////////////////////////////
     // InitCommon
     ////////////////////////////////////////////////////////////////////////////
@@ -7,6 +7,8 @@
 #include <boost/format.hpp>
 #include <boost/lexical_cast.hpp>
 
+#include <map>
+
 
 using namespace std;
 using namespace ak;
@@ -23,6 +25,7 @@ namespace
     const size_t MAX_NAME_SIZE = 60;
     const size_t MAX_ATTR_COUNT = 500;
     const size_t MAX_REL_VAR_COUNT = 500;
+    const size_t MAX_STATEMENT_COUNT = 256;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -56,9 +59,12 @@ namespace
     class Meta;
 
 
+    typedef vector<pqxx::result::tuple> Tuples;
+
+
     class RelVar {
     public:
-        RelVar(const string& name);
+        RelVar(const string& name, const Tuples& attr_tuples);
 
         RelVar(const Meta& meta,
                const string& name,
@@ -67,7 +73,7 @@ namespace
                const ForeignKeySet& foreign_key_set,
                const Strings& checks);
 
-        void LoadConstrs(const Meta& meta);
+        void LoadConstrs(const Meta& meta, const Tuples& constr_tuples);
         string GetName() const;
         const DefHeader& GetDefHeader() const;
         const Header& GetHeader() const;
@@ -138,24 +144,24 @@ namespace
 
     pqxx::result Exec(const string& sql);
     pqxx::result ExecSafely(const string& sql);
+    pqxx::result Exec(const Statement& statement);
+    pqxx::result ExecSafely(const Statement& statement);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // RelVar definitions
 ////////////////////////////////////////////////////////////////////////////////
 
-RelVar::RelVar(const string& name)
+// Attribute tuples come from ak.describe_schema
+RelVar::RelVar(const string& name, const Tuples& attr_tuples)
     : name_(name)
 {
-    static const format query("SELECT * FROM ak.describe_table('\"%1%\"');");
-    pqxx::result pqxx_result = Exec((format(query) % name_).str());
-    def_header_.reserve(pqxx_result.size());
-    BOOST_FOREACH(const pqxx::result::tuple& tuple, pqxx_result) {
-        AK_ASSERT_EQUAL(tuple.size(), 3);
-        AK_ASSERT(!tuple[0].is_null() && !tuple[1].is_null());
-        DefAttr def_attr(tuple[0].c_str(), ReadPgType(tuple[1].c_str()));
-        if (!tuple[2].is_null()) {
-            string def_str(tuple[2].c_str());
+    def_header_.reserve(attr_tuples.size());
+    BOOST_FOREACH(const pqxx::result::tuple& tuple, attr_tuples) {
+        AK_ASSERT(!tuple[2].is_null() && !tuple[3].is_null());
+        DefAttr def_attr(tuple[2].c_str(), ReadPgType(tuple[3].c_str()));
+        if (!tuple[4].is_null()) {
+            string def_str(tuple[4].c_str());
             if (def_str.substr(0, 8) == "nextval(") {
                 AK_ASSERT(def_attr.type == Type::INTEGER);
                 def_attr.type = Type::SERIAL;
@@ -242,22 +248,20 @@ RelVar::RelVar(const Meta& meta,
 }
 
 
-void RelVar::LoadConstrs(const Meta& meta) {
-    static const format query("SELECT * FROM ak.describe_constrs('\"%1%\"')");
-    pqxx::result pqxx_result = Exec((format(query) % name_).str());
-    BOOST_FOREACH(const pqxx::result::tuple& tuple, pqxx_result) {
-        AK_ASSERT_EQUAL(tuple.size(), 4);
-        AK_ASSERT(!tuple[0].is_null() && !tuple[1].is_null());
-        AK_ASSERT_EQUAL(string(tuple[0].c_str()).size(), 1);
-        StringSet attr_names(ReadAttrNames(tuple[1].c_str()));
-        char constr_code = tuple[0].c_str()[0];
+// Constraint tuples come from ak.describe_schema
+void RelVar::LoadConstrs(const Meta& meta, const Tuples& constr_tuples) {
+    BOOST_FOREACH(const pqxx::result::tuple& tuple, constr_tuples) {
+        AK_ASSERT(!tuple[5].is_null());
+        StringSet attr_names(ReadAttrNames(tuple[5].c_str()));
+        AK_ASSERT(!tuple[8].is_null());
+        char constr_code = tuple[8].c_str()[0];
         if (constr_code == 'p' || constr_code == 'u') {
             unique_key_set_.add(attr_names);
         } else if (constr_code == 'f') {
-            AK_ASSERT(!tuple[2].is_null() && !tuple[3].is_null());
-            string ref_rel_var_name(tuple[2].c_str());
+            AK_ASSERT(!tuple[6].is_null() && !tuple[7].is_null());
+            string ref_rel_var_name(tuple[6].c_str());
             StringSet ref_attr_names(
-                meta.Get(ref_rel_var_name).ReadAttrNames(tuple[3].c_str()));
+                meta.Get(ref_rel_var_name).ReadAttrNames(tuple[7].c_str()));
             foreign_key_set_.add(
                 ForeignKey(attr_names, ref_rel_var_name, ref_attr_names));
         };
@@ -669,18 +673,33 @@ void RelVar::DropAllConstrs()
 // Meta definitions
 ////////////////////////////////////////////////////////////////////////////////
 
+// The whole schema is read by one query
 Meta::Meta(const string& quoted_schema_name)
 {
-    static const format query("SELECT * FROM ak.get_schema_tables(%1%);");
+    static const format query("SELECT * FROM ak.describe_schema(%1%);");
     pqxx::result pqxx_result = Exec((format(query) % quoted_schema_name).str());
-    rel_vars_.reserve(pqxx_result.size());
+    Strings names;
+    map<string, Tuples> attr_tuples_map, constr_tuples_map;
     BOOST_FOREACH(const pqxx::result::tuple& tuple, pqxx_result) {
-        AK_ASSERT_EQUAL(tuple.size(), 1);
-        AK_ASSERT(!tuple[0].is_null());
-        rel_vars_.push_back(RelVar(tuple[0].c_str()));
+        AK_ASSERT_EQUAL(tuple.size(), 9);
+        AK_ASSERT(!tuple[0].is_null() && !tuple[1].is_null());
+        AK_ASSERT_EQUAL(string(tuple[1].c_str()).size(), 1);
+        string name(tuple[0].c_str());
+        char kind = tuple[1].c_str()[0];
+        if (kind == 't')
+            names.push_back(name);
+        else if (kind == 'a')
+            attr_tuples_map[name].push_back(tuple);
+        else {
+            AK_ASSERT_EQUAL(kind, 'c');
+            constr_tuples_map[name].push_back(tuple);
+        }
     }
+    rel_vars_.reserve(names.size());
+    BOOST_FOREACH(const string& name, names)
+        rel_vars_.push_back(RelVar(name, attr_tuples_map[name]));
     BOOST_FOREACH(RelVar& rel_var, rel_vars_)
-        rel_var.LoadConstrs(*this);
+        rel_var.LoadConstrs(*this, constr_tuples_map[rel_var.GetName()]);
 }
 
 
@@ -796,16 +815,21 @@ namespace
            const string& schema_name,
            const string& tablespace_name);
 
+        void Begin();
         const Meta& GetMeta();
         Meta& ChangeMeta();
         string Escape(const string& str, bool raw);
         string Quote(const string& str);
         pqxx::result Exec(const string& sql);
         pqxx::result ExecSafely(const string& sql);
+        pqxx::result Exec(const Statement& statement);
+        pqxx::result ExecSafely(const Statement& statement);
         void Commit();
         void RollBack();
 
     private:
+        typedef map<string, string> StatementMap;
+
         pqxx::connection conn_;
         string quoted_schema_name_;
         string get_meta_state_sql_;
@@ -814,9 +838,24 @@ namespace
         auto_ptr<Meta> meta_ptr_;
         bool meta_changed_;
         auto_ptr<pqxx::work> work_ptr_;
+        StatementMap statement_map_;
+        size_t statement_count_;
+        Strings stale_statement_names_;
 
         pqxx::work& GetWork();
+        const string& Prepare(const Statement& statement);
+        void UnprepareAll();
+        void DropStaleStatements();
     };
+
+
+    pqxx::result Invoke(pqxx::prepare::invocation invocation,
+                        const Values& params)
+    {
+        BOOST_FOREACH(const Value& value, params)
+            invocation(value.GetPgText());
+        return invocation.exec();
+    }
 }
 
 
@@ -825,6 +864,7 @@ DB::DB(const string& options,
        const string& tablespace_name)
     : conn_(options)
     , quoted_schema_name_(Quote(schema_name))
+    , statement_count_(0)
 {
     static const format set_cmd(
         "SET search_path TO %1%, pg_catalog;"
@@ -842,6 +882,12 @@ DB::DB(const string& options,
 }
 
 
+void DB::Begin()
+{
+    GetWork();
+}
+
+
 const Meta& DB::GetMeta()
 {
     GetWork();
@@ -857,6 +903,8 @@ Meta& DB::ChangeMeta()
 {
     GetWork();
     meta_changed_ = true;
+    UnprepareAll();
+    ClearTranslations();
     if (!meta_ptr_.get())
         meta_ptr_.reset(new Meta(quoted_schema_name_));
     return *meta_ptr_;
@@ -881,6 +929,8 @@ string DB::Quote(const string& str)
 pqxx::work& DB::GetWork()
 {
     if (!work_ptr_.get()) {
+        SpanTimer timer(DB_SPAN);
+        DropStaleStatements();
         work_ptr_.reset(new pqxx::work(conn_));
         pqxx::result pqxx_result(work_ptr_->exec(get_meta_state_sql_));
         AK_ASSERT_EQUAL(pqxx_result.size(), 1);
@@ -889,21 +939,84 @@ pqxx::work& DB::GetWork()
         if (meta_state_ != new_meta_state) {
             meta_ptr_.reset();
             meta_state_ = new_meta_state;
+            UnprepareAll();
+            ClearTranslations();
         }
     }
     return *work_ptr_;
 }
 
 
+const string& DB::Prepare(const Statement& statement)
+{
+    StatementMap::const_iterator itr(statement_map_.find(statement.sql));
+    if (itr != statement_map_.end())
+        return itr->second;
+    if (statement_map_.size() == MAX_STATEMENT_COUNT)
+        UnprepareAll();
+    string name("ak_" + lexical_cast<string>(++statement_count_));
+    pqxx::prepare::declaration declaration(conn_.prepare(name, statement.sql));
+    BOOST_FOREACH(const Value& value, statement.params)
+        declaration(value.GetPgType(), pqxx::prepare::treat_string);
+    return statement_map_[statement.sql] = name;
+}
+
+
+// DEALLOCATE would fail in an aborted transaction, so the statements are
+// forgotten at once and deallocated before the next transaction begins;
+// their names are never reused
+void DB::UnprepareAll()
+{
+    BOOST_FOREACH(const StatementMap::value_type& item, statement_map_)
+        stale_statement_names_.push_back(item.second);
+    statement_map_.clear();
+}
+
+
+void DB::DropStaleStatements()
+{
+    BOOST_FOREACH(const string& name, stale_statement_names_) {
+        try {
+            conn_.unprepare(name);
+        } catch (const pqxx::sql_error&) {
+            // The statement has gone with its session
+        }
+    }
+    stale_statement_names_.clear();
+}
+
+
 pqxx::result DB::Exec(const string& sql)
 {
-    return GetWork().exec(sql);
+    pqxx::work& work(GetWork());
+    SpanTimer timer(DB_SPAN);
+    return work.exec(sql);
 }
 
 
 pqxx::result DB::ExecSafely(const string& sql)
 {
-    return pqxx::subtransaction(GetWork()).exec(sql);
+    pqxx::work& work(GetWork());
+    SpanTimer timer(DB_SPAN);
+    return pqxx::subtransaction(work).exec(sql);
+}
+
+
+pqxx::result DB::Exec(const Statement& statement)
+{
+    pqxx::work& work(GetWork());
+    const string& name(Prepare(statement));
+    SpanTimer timer(DB_SPAN);
+    return Invoke(work.prepared(name), statement.params);
+}
+
+
+pqxx::result DB::ExecSafely(const Statement& statement)
+{
+    pqxx::work& work(GetWork());
+    const string& name(Prepare(statement));
+    SpanTimer timer(DB_SPAN);
+    return Invoke(pqxx::subtransaction(work).prepared(name), statement.params);
 }
 
 
@@ -911,6 +1024,7 @@ void DB::Commit()
 {
     if (!work_ptr_.get())
         return;
+    SpanTimer timer(DB_SPAN);
     if (meta_changed_) {
         work_ptr_->exec(set_meta_state_sql_ +
                         lexical_cast<string>(++meta_state_) + ')');
@@ -924,8 +1038,11 @@ void DB::Commit()
 void DB::RollBack()
 {
     work_ptr_.reset();
-    if (meta_changed_)
+    if (meta_changed_) {
         meta_ptr_.reset();
+        UnprepareAll();
+        ClearTranslations();
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -936,22 +1053,49 @@ namespace
 {
     DB* db_ptr = 0;
 
+    string db_options;
+    string db_schema_name;
+    string db_tablespace_name;
+
+
+    // Connect on first use so the connection is not shared by forked workers
+    DB& GetDB()
+    {
+        if (!db_ptr) {
+            static DB db(db_options, db_schema_name, db_tablespace_name);
+            db_ptr = &db;
+        }
+        return *db_ptr;
+    }
+
 
     pqxx::result Exec(const string& sql)
     {
-        return db_ptr->Exec(sql);
+        return GetDB().Exec(sql);
     }
 
 
     pqxx::result ExecSafely(const string& sql)
     {
-        return db_ptr->ExecSafely(sql);
+        return GetDB().ExecSafely(sql);
+    }
+
+
+    pqxx::result Exec(const Statement& statement)
+    {
+        return GetDB().Exec(statement);
+    }
+
+
+    pqxx::result ExecSafely(const Statement& statement)
+    {
+        return GetDB().ExecSafely(statement);
     }
 
 
     string Escape(const string& str, bool raw)
     {
-        return db_ptr->Escape(str, raw);
+        return GetDB().Escape(str, raw);
     }
 
 
@@ -960,7 +1104,7 @@ namespace
                          std::string& ref_rel_var_name,
                          StringSet& ref_attr_names)
     {
-        const RelVar& rel_var(db_ptr->GetMeta().Get(key_rel_var_name));
+        const RelVar& rel_var(GetDB().GetMeta().Get(key_rel_var_name));
         const ForeignKey* foreign_key_ptr = 0;
         BOOST_FOREACH(const ForeignKey& foreign_key,
                       rel_var.GetForeignKeySet()) {
@@ -978,6 +1122,82 @@ namespace
     }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// QueryResult
+////////////////////////////////////////////////////////////////////////////////
+
+class QueryResult::Impl {
+public:
+    Header header;
+    pqxx::result pqxx_result;
+
+    pqxx::result::field GetField(size_t tuple_idx, size_t attr_idx) const {
+        return pqxx_result[tuple_idx][attr_idx];
+    }
+};
+
+
+QueryResult::QueryResult(Impl* pimpl)
+    : pimpl_(pimpl)
+{
+}
+
+
+QueryResult::~QueryResult()
+{
+}
+
+
+const Header& QueryResult::GetHeader() const
+{
+    return pimpl_->header;
+}
+
+
+size_t QueryResult::GetSize() const
+{
+    // A nullary relation has at most one tuple
+    if (pimpl_->header.empty())
+        return pimpl_->pqxx_result.empty() ? 0 : 1;
+    return pimpl_->pqxx_result.size();
+}
+
+
+double QueryResult::GetNumber(size_t tuple_idx, size_t attr_idx) const
+{
+    return pimpl_->GetField(tuple_idx, attr_idx).as<double>();
+}
+
+
+bool QueryResult::GetBoolean(size_t tuple_idx, size_t attr_idx) const
+{
+    return pimpl_->GetField(tuple_idx, attr_idx).as<bool>();
+}
+
+
+double QueryResult::GetDate(size_t tuple_idx, size_t attr_idx) const
+{
+    return ReadPgDate(pimpl_->GetField(tuple_idx, attr_idx).c_str());
+}
+
+
+const char* QueryResult::GetChars(size_t tuple_idx, size_t attr_idx) const
+{
+    return pimpl_->GetField(tuple_idx, attr_idx).c_str();
+}
+
+
+size_t QueryResult::GetLength(size_t tuple_idx, size_t attr_idx) const
+{
+    return pimpl_->GetField(tuple_idx, attr_idx).size();
+}
+
+
+string QueryResult::GetBinary(size_t tuple_idx, size_t attr_idx) const
+{
+    return pqxx::binarystring(pimpl_->GetField(tuple_idx, attr_idx)).str();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // API
 ////////////////////////////////////////////////////////////////////////////////
@@ -1009,19 +1229,21 @@ namespace
 
 void ak::Commit()
 {
-    db_ptr->Commit();
+    if (db_ptr)
+        db_ptr->Commit();
 }
 
 
 void ak::RollBack()
 {
-    db_ptr->RollBack();
+    if (db_ptr)
+        db_ptr->RollBack();
 }
 
 
 StringSet ak::GetRelVarNames()
 {
-    const RelVars& rel_vars(db_ptr->GetMeta().GetAll());
+    const RelVars& rel_vars(GetDB().GetMeta().GetAll());
     StringSet result;
     result.reserve(rel_vars.size());
     BOOST_FOREACH(const RelVar& rel_var, rel_vars)
@@ -1032,25 +1254,25 @@ StringSet ak::GetRelVarNames()
 
 const Header& ak::GetHeader(const string& rel_var_name)
 {
-    return db_ptr->GetMeta().Get(rel_var_name).GetHeader();
+    return GetDB().GetMeta().Get(rel_var_name).GetHeader();
 }
 
 
 const DefHeader& ak::GetDefHeader(const string& rel_var_name)
 {
-    return db_ptr->GetMeta().Get(rel_var_name).GetDefHeader();
+    return GetDB().GetMeta().Get(rel_var_name).GetDefHeader();
 }
 
 
 const UniqueKeySet& ak::GetUniqueKeySet(const string& rel_var_name)
 {
-    return db_ptr->GetMeta().Get(rel_var_name).GetUniqueKeySet();
+    return GetDB().GetMeta().Get(rel_var_name).GetUniqueKeySet();
 }
 
 
 const ForeignKeySet& ak::GetForeignKeySet(const string& rel_var_name)
 {
-    return db_ptr->GetMeta().Get(rel_var_name).GetForeignKeySet();
+    return GetDB().GetMeta().Get(rel_var_name).GetForeignKeySet();
 }
 
 
@@ -1060,46 +1282,45 @@ void ak::CreateRelVar(const string& name,
                       const ForeignKeySet& foreign_key_set,
                       const Strings& checks)
 {
-    db_ptr->ChangeMeta().Create(
+    GetDB().ChangeMeta().Create(
         name, def_header, unique_key_set, foreign_key_set, checks);
 }
 
 
 void ak::DropRelVars(const StringSet& rel_var_names)
 {
-    db_ptr->ChangeMeta().Drop(rel_var_names);
-}
-
-
-void ak::Query(Header& header,
-               vector<Values>& tuples,
-               const string& query,
-               const Drafts& query_params,
-               const Strings& by_exprs,
-               const Drafts& by_params,
-               size_t start,
-               size_t length)
-{
-    string sql(
-        TranslateQuery(
-            header, query, query_params, by_exprs, by_params, start, length));
-    pqxx::result pqxx_result(Exec(sql));
-    tuples.clear();
-    if (header.empty()) {
-        if (!pqxx_result.empty())
-            tuples.push_back(Values());
-    } else {
-        tuples.reserve(pqxx_result.size());
-        BOOST_FOREACH(const pqxx::result::tuple& pqxx_tuple, pqxx_result)
-            tuples.push_back(GetTupleValues(pqxx_tuple, header));
-    }
+    GetDB().ChangeMeta().Drop(rel_var_names);
+}
+
+
+QueryResult ak::Query(const string& query,
+                      const Drafts& query_params,
+                      const Strings& by_exprs,
+                      const Drafts& by_params,
+                      size_t start,
+                      size_t length)
+{
+    // Cached translations are checked against the meta state
+    GetDB().Begin();
+    QueryResult::Impl* impl_ptr = new QueryResult::Impl();
+    QueryResult result(impl_ptr);
+    Statement statement(
+        TranslateQuery(impl_ptr->header,
+                       query,
+                       query_params,
+                       by_exprs,
+                       by_params,
+                       start,
+                       length));
+    impl_ptr->pqxx_result = Exec(statement);
+    return result;
 }
 
 
 size_t ak::Count(const string& query, const Drafts& params)
 {
-    string sql(TranslateCount(query, params));
-    pqxx::result pqxx_result(Exec(sql));
+    GetDB().Begin();
+    pqxx::result pqxx_result(Exec(TranslateCount(query, params)));
     AK_ASSERT_EQUAL(pqxx_result.size(), 1);
     AK_ASSERT_EQUAL(pqxx_result[0].size(), 1);
     return pqxx_result[0][0].as<size_t>();
@@ -1115,11 +1336,11 @@ size_t ak::Update(const string& rel_var_name,
     const Header& header(GetHeader(rel_var_name));
     BOOST_FOREACH(const NamedString& named_expr, expr_map)
         GetAttr(header, named_expr.name);
-    string sql(
+    Statement statement(
         TranslateUpdate(
             rel_var_name, where, where_params, expr_map, expr_params));
     try{
-        return ExecSafely(sql).affected_rows();
+        return ExecSafely(statement).affected_rows();
     } catch (const pqxx::integrity_constraint_violation& err) {
         throw Error(Error::CONSTRAINT, err.what());
     } catch (const pqxx::data_exception& err) {
@@ -1134,9 +1355,10 @@ size_t ak::Delete(const string& rel_var_name,
                   const string& where,
                   const Drafts& params)
 {
-    string sql(TranslateDelete(rel_var_name, where, params));
+    GetDB().Begin();
+    Statement statement(TranslateDelete(rel_var_name, where, params));
     try {
-        return ExecSafely(sql).affected_rows();
+        return ExecSafely(statement).affected_rows();
     } catch (const pqxx::integrity_constraint_violation& err) {
         throw Error(Error::CONSTRAINT, err.what());
     } catch (const pqxx::sql_error& err) {
@@ -1151,7 +1373,7 @@ Values ak::Insert(const string& rel_var_name, const DraftMap& draft_map)
     static const format def_cmd(
         "INSERT INTO \"%1%\" DEFAULT VALUES RETURNING *;");
 
-    const RelVar& rel_var(db_ptr->GetMeta().Get(rel_var_name));
+    const RelVar& rel_var(GetDB().GetMeta().Get(rel_var_name));
     const DefHeader& def_header(rel_var.GetDefHeader());
     string sql;
     if (def_header.empty()) {
@@ -1208,27 +1430,27 @@ Values ak::Insert(const string& rel_var_name, const DraftMap& draft_map)
 
 void ak::AddAttrs(const string& rel_var_name, const ValHeader& val_attr_set)
 {
-    db_ptr->ChangeMeta().Get(rel_var_name).AddAttrs(val_attr_set);
+    GetDB().ChangeMeta().Get(rel_var_name).AddAttrs(val_attr_set);
 }
 
 
 void ak::DropAttrs(const string& rel_var_name,
                    const StringSet& attr_names)
 {
-    db_ptr->ChangeMeta().Get(rel_var_name).DropAttrs(attr_names);
+    GetDB().ChangeMeta().Get(rel_var_name).DropAttrs(attr_names);
 }
 
 
 void ak::AddDefault(const string& rel_var_name, const DraftMap& draft_map)
 {
-    db_ptr->ChangeMeta().Get(rel_var_name).AddDefault(draft_map);
+    GetDB().ChangeMeta().Get(rel_var_name).AddDefault(draft_map);
 }
 
 
 void ak::DropDefault(const string& rel_var_name,
                      const StringSet& attr_names)
 {
-    db_ptr->ChangeMeta().Get(rel_var_name).DropDefault(attr_names);
+    GetDB().ChangeMeta().Get(rel_var_name).DropDefault(attr_names);
 }
 
 
@@ -1237,7 +1459,7 @@ void ak::AddConstrs(const string& rel_var_name,
                     const ForeignKeySet& foreign_key_set,
                     const Strings& checks)
 {
-    Meta& meta(db_ptr->ChangeMeta());
+    Meta& meta(GetDB().ChangeMeta());
     meta.Get(rel_var_name).AddConstrs(
         meta, unique_key_set, foreign_key_set, checks);
 }
@@ -1245,17 +1467,21 @@ void ak::AddConstrs(const string& rel_var_name,
 
 void ak::DropAllConstrs(const string& rel_var_name)
 {
-    db_ptr->ChangeMeta().Get(rel_var_name).DropAllConstrs();
+    GetDB().ChangeMeta().Get(rel_var_name).DropAllConstrs();
 }
 
 
 void ak::InitDatabase(const string& options,
                       const string& schema_name,
-                      const string& tablespace_name)
+                      const string& tablespace_name,
+                      bool lazy)
 {
     AK_ASSERT(!db_ptr);
-    static DB db(options, schema_name, tablespace_name);
-    db_ptr = &db;
+    db_options = options;
+    db_schema_name = schema_name;
+    db_tablespace_name = tablespace_name;
+    if (!lazy)
+        GetDB();
     InitCommon(Escape);
     InitTranslator(GetHeader, FollowReference);
 }
@@ -62,6 +62,31 @@ namespace ak
 
     typedef orset<ValAttr, NameGetter> ValHeader;
 
+    ////////////////////////////////////////////////////////////////////////////
+    // QueryResult
+    ////////////////////////////////////////////////////////////////////////////
+
+    // Tuples are read in place from the database reply
+    class QueryResult {
+    public:
+        class Impl;
+
+        QueryResult(Impl* pimpl);
+        ~QueryResult();
+
+        const Header& GetHeader() const;
+        size_t GetSize() const;
+        double GetNumber(size_t tuple_idx, size_t attr_idx) const;
+        bool GetBoolean(size_t tuple_idx, size_t attr_idx) const;
+        double GetDate(size_t tuple_idx, size_t attr_idx) const;
+        const char* GetChars(size_t tuple_idx, size_t attr_idx) const;
+        size_t GetLength(size_t tuple_idx, size_t attr_idx) const;
+        std::string GetBinary(size_t tuple_idx, size_t attr_idx) const;
+
+    private:
+        boost::shared_ptr<Impl> pimpl_;
+    };
+
     ////////////////////////////////////////////////////////////////////////////
     // API
     ////////////////////////////////////////////////////////////////////////////
@@ -82,14 +107,12 @@ namespace ak
 
     void DropRelVars(const StringSet& rel_var_names);
 
-    void Query(Header& header,
-               std::vector<Values>& tuples,
-               const std::string& query,
-               const Drafts& query_params = Drafts(),
-               const Strings& by_exprs = Strings(),
-               const Drafts& by_params = Drafts(),
-               size_t start = 0,
-               size_t length = MINUS_ONE);
+    QueryResult Query(const std::string& query,
+                      const Drafts& query_params = Drafts(),
+                      const Strings& by_exprs = Strings(),
+                      const Drafts& by_params = Drafts(),
+                      size_t start = 0,
+                      size_t length = MINUS_ONE);
 
     size_t Count(const std::string& query, const Drafts& params = Drafts());
 
@@ -125,9 +148,11 @@ namespace ak
 
     void DropAllConstrs(const std::string& rel_var_name);
 
+    // With lazy the connection is established on the first database call
     void InitDatabase(const std::string& options,
                       const std::string& schema_name,
-                      const std::string& tablespace_name);
+                      const std::string& tablespace_name,
+                      bool lazy = false);
 }
 
 #endif // DB_H
@@ -107,7 +107,7 @@
     if (!code)
       return null;
     var func = new basis.script.Script(
-      '(function (require, exports, module) {\n' + code + '\n})',
+      basis.script.moduleHead + code + basis.script.moduleTail,
       place.prefix + path, -1).run();
     var require = makeRequire(place, dir);
     var exports = place.cache[id] =
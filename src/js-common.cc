@@ -1,6 +1,7 @@
 // (c) 2009-2011 by Anton Korenyushkin
 
 #include "js-common.h"
+#include "profiler.h"
 
 #include <boost/lexical_cast.hpp>
 
@@ -128,13 +129,17 @@ ExecutionGuard::~ExecutionGuard()
 }
 
 
-CallbackGuard::CallbackGuard()
+CallbackGuard::CallbackGuard(const char* name)
+    : name_(name)
+    , start_(IsProfiling() ? GetMicroTime() : 0)
 {
     in_callback = true;
 }
 
 
 CallbackGuard::~CallbackGuard() {
+    if (start_ && IsProfiling())
+        RecordNativeFrame(name_, GetMicroTime() - start_);
     in_callback = false;
     if (timed_out)
         v8::V8::TerminateExecution();
@@ -105,9 +105,16 @@ namespace ak
     };
 
 
-    struct CallbackGuard {
-        CallbackGuard();
+    // Time spent in the callback is recorded as a native frame while the
+    // profiler is running
+    class CallbackGuard {
+    public:
+        CallbackGuard(const char* name);
         ~CallbackGuard();
+
+    private:
+        const char* name_;
+        uint64_t start_;
     };
 
 
@@ -343,8 +350,8 @@ namespace ak
     T name##Impl(T1, T2, T3)
 
 
-#define JS_CALLBACK_GUARD(T)                        \
-    ak::CallbackGuard callback_guard__;             \
+#define JS_CALLBACK_GUARD(T, name)                  \
+    ak::CallbackGuard callback_guard__(name);       \
     if (ak::TimedOut())                             \
         return T()
 
@@ -353,7 +360,7 @@ namespace ak
     v8::Handle<v8::Value> name##Impl(const Arguments&);     \
     v8::Handle<v8::Value> name(const Arguments& a)          \
     {                                                       \
-        JS_CALLBACK_GUARD(v8::Handle<v8::Value>);           \
+        JS_CALLBACK_GUARD(v8::Handle<v8::Value>, #name);    \
         try {                                               \
             return name##Impl(a);                           \
         } JS_CATCH(v8::Handle<v8::Value>);                  \
@@ -365,7 +372,7 @@ namespace ak
 #define DEFINE_JS_CALLBACK1(T, cls, name, T1, arg1)                     \
     T cls::name(T1 a1)                                                  \
     {                                                                   \
-        JS_CALLBACK_GUARD(T);                                           \
+        JS_CALLBACK_GUARD(T, #cls "::" #name);                          \
         try {                                                           \
             return ak::GetBg<cls>(a1.Holder()).name##Impl(a1);          \
         } JS_CATCH(T);                                                  \
@@ -376,7 +383,7 @@ namespace ak
 #define DEFINE_JS_CALLBACK2(T, cls, name, T1, arg1, T2, arg2)           \
     T cls::name(T1 a1, T2 a2)                                           \
     {                                                                   \
-        JS_CALLBACK_GUARD(T);                                           \
+        JS_CALLBACK_GUARD(T, #cls "::" #name);                          \
         try {                                                           \
             return ak::GetBg<cls>(a2.Holder()).name##Impl(a1, a2);      \
         } JS_CATCH(T);                                                  \
@@ -387,7 +394,7 @@ namespace ak
 #define DEFINE_JS_CALLBACK3(T, cls, name, T1, arg1, T2, arg2, T3, arg3) \
     T cls::name(T1 a1, T2 a2, T3 a3)                                    \
     {                                                                   \
-        JS_CALLBACK_GUARD(T);                                           \
+        JS_CALLBACK_GUARD(T, #cls "::" #name);                          \
         try {                                                           \
             return ak::GetBg<cls>(a3.Holder()).name##Impl(a1, a2, a3);  \
         } JS_CATCH(T);                                                  \
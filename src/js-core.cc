@@ -2,6 +2,7 @@
 
 #include "js-core.h"
 #include "js-common.h"
+#include "js.h"
 
 
 using namespace ak;
@@ -64,10 +65,24 @@ namespace
             values.push_back(array->Get(Integer::New(i)));
         return constructor->NewInstance(array->Length(), &values[0]);
     }
+
+
+    DEFINE_JS_FUNCTION(GetRequestTimingCb, /*args*/)
+    {
+        RequestTiming timing(GetRequestTiming());
+        Handle<Object> result(Object::New());
+        Set(result, "total", Number::New(timing.total / 1000.0));
+        Set(result, "js", Number::New(timing.js / 1000.0));
+        Set(result, "translation", Number::New(timing.translation / 1000.0));
+        Set(result, "db", Number::New(timing.db / 1000.0));
+        Set(result, "socket", Number::New(timing.socket / 1000.0));
+        Set(result, "gc", Number::New(timing.gc / 1000.0));
+        return result;
+    }
 }
 
 
-Handle<Object> ak::InitCore(bool managed)
+Handle<Object> ak::InitCore(bool managed, bool server_timing)
 {
     Handle<Object> result(Object::New());
     if (!managed)
@@ -75,5 +90,7 @@ Handle<Object> ak::InitCore(bool managed)
     SetFunction(result, "set", SetCb);
     SetFunction(result, "hash", HashCb);
     SetFunction(result, "construct", ConstructCb);
+    SetFunction(result, "getRequestTiming", GetRequestTimingCb);
+    Set(result, "serverTiming", Boolean::New(server_timing));
     return result;
 }
@@ -10,7 +10,9 @@
 
 namespace ak
 {
-    v8::Handle<v8::Object> InitCore(bool managed);
+    // With server_timing core.serverTiming is true and jsgi reports the
+    // request timing in the Server-Timing header
+    v8::Handle<v8::Object> InitCore(bool managed, bool server_timing);
 }
 
 #endif // JS_SCRIPT_H
@@ -5,6 +5,8 @@
 #include "js-binary.h"
 #include "db.h"
 
+#include <map>
+
 
 using namespace std;
 using namespace ak;
@@ -159,6 +161,100 @@ namespace
     }
 
 
+    // Interned attribute names and a boilerplate row of a result header.
+    // Rows cloned from the boilerplate share its hidden class.
+    class RowShape : private boost::noncopyable {
+    public:
+        RowShape(const Header& header);
+        ~RowShape();
+
+        Handle<Object> NewRow() const {
+            return boilerplate_->Clone();
+        }
+
+        Handle<String> GetName(size_t attr_idx) const {
+            return names_[attr_idx];
+        }
+
+    private:
+        Persistent<Object> boilerplate_;
+        vector<Persistent<String> > names_;
+    };
+
+
+    RowShape::RowShape(const Header& header)
+    {
+        HandleScope handle_scope;
+        Handle<Object> boilerplate(Object::New());
+        names_.reserve(header.size());
+        BOOST_FOREACH(const Attr& attr, header) {
+            Handle<String> name(String::NewSymbol(attr.name.c_str()));
+            names_.push_back(Persistent<String>::New(name));
+            boilerplate->Set(name, Undefined());
+        }
+        boilerplate_ = Persistent<Object>::New(boilerplate);
+    }
+
+
+    RowShape::~RowShape()
+    {
+        boilerplate_.Dispose();
+        BOOST_FOREACH(Persistent<String>& name, names_)
+            name.Dispose();
+    }
+
+
+    const size_t MAX_ROW_SHAPE_COUNT = 256;
+    typedef map<string, shared_ptr<RowShape> > RowShapeMap;
+    RowShapeMap row_shape_map;
+
+
+    const RowShape& GetRowShape(const Header& header)
+    {
+        string key;
+        BOOST_FOREACH(const Attr& attr, header)
+            key += attr.name + ' ';
+        RowShapeMap::const_iterator itr(row_shape_map.find(key));
+        if (itr != row_shape_map.end())
+            return *itr->second;
+        if (row_shape_map.size() == MAX_ROW_SHAPE_COUNT)
+            row_shape_map.clear();
+        shared_ptr<RowShape>& shape_ptr(row_shape_map[key]);
+        shape_ptr.reset(new RowShape(header));
+        return *shape_ptr;
+    }
+
+
+    Handle<v8::Value> MakeV8Value(const QueryResult& result,
+                                  size_t tuple_idx,
+                                  size_t attr_idx,
+                                  Type type)
+    {
+        if (type.IsNumeric())
+            return Number::New(result.GetNumber(tuple_idx, attr_idx));
+        if (type == Type::STRING)
+            return String::New(result.GetChars(tuple_idx, attr_idx),
+                               result.GetLength(tuple_idx, attr_idx));
+        if (type == Type::BOOLEAN)
+            return Boolean::New(result.GetBoolean(tuple_idx, attr_idx));
+        if (type == Type::DATE)
+            return Date::New(result.GetDate(tuple_idx, attr_idx));
+        if (type == Type::BINARY) {
+            string s(result.GetBinary(tuple_idx, attr_idx));
+            return NewBinary(auto_ptr<Chars>(new Chars(s.begin(), s.end())));
+        }
+        AK_ASSERT(type == Type::JSON);
+        Handle<v8::Value> arg(
+            String::New(result.GetChars(tuple_idx, attr_idx),
+                        result.GetLength(tuple_idx, attr_idx)));
+        Handle<v8::Value> value(
+            parse_json_func->Call(Context::GetCurrent()->Global(), 1, &arg));
+        if (value.IsEmpty())
+            throw Propagate();
+        return value;
+    }
+
+
     template <typename ContainerT>
     Handle<Array> MakeV8Array(const ContainerT& container)
     {
@@ -245,6 +341,79 @@ namespace
     }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// NumberColumnBg
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    // Packed doubles of a numeric or date result column
+    class NumberColumnBg {
+    public:
+        DECLARE_JS_CLASS(NumberColumnBg);
+
+        NumberColumnBg(const QueryResult& query_result, size_t attr_idx);
+        ~NumberColumnBg();
+
+        Handle<Object> Wrap();
+
+    private:
+        vector<double> data_;
+
+        DECLARE_JS_CALLBACK2(Handle<v8::Value>, GetLengthCb,
+                             Local<String>,
+                             const AccessorInfo&) const;
+    };
+}
+
+
+DEFINE_JS_CLASS(NumberColumnBg, "NumberColumn",
+                object_template, /*proto_template*/)
+{
+    object_template->SetAccessor(String::NewSymbol("length"), GetLengthCb,
+                                 0, Handle<v8::Value>(), DEFAULT,
+                                 ReadOnly | DontEnum | DontDelete);
+}
+
+
+NumberColumnBg::NumberColumnBg(const QueryResult& query_result,
+                               size_t attr_idx)
+{
+    size_t size = query_result.GetSize();
+    data_.resize(size);
+    if (query_result.GetHeader()[attr_idx].type == Type::DATE) {
+        for (size_t tuple_idx = 0; tuple_idx < size; ++tuple_idx)
+            data_[tuple_idx] = query_result.GetDate(tuple_idx, attr_idx);
+    } else {
+        for (size_t tuple_idx = 0; tuple_idx < size; ++tuple_idx)
+            data_[tuple_idx] = query_result.GetNumber(tuple_idx, attr_idx);
+    }
+    V8::AdjustAmountOfExternalAllocatedMemory(size * sizeof(double));
+}
+
+
+NumberColumnBg::~NumberColumnBg()
+{
+    V8::AdjustAmountOfExternalAllocatedMemory(-data_.size() * sizeof(double));
+}
+
+
+Handle<Object> NumberColumnBg::Wrap()
+{
+    Handle<Object> result(GetJSClass().Instantiate(this));
+    result->SetIndexedPropertiesToExternalArrayData(
+        data_.empty() ? 0 : &data_[0], kExternalDoubleArray, data_.size());
+    return result;
+}
+
+
+DEFINE_JS_CALLBACK2(Handle<v8::Value>, NumberColumnBg, GetLengthCb,
+                    Local<String>, /*property*/,
+                    const AccessorInfo&, /*info*/) const
+{
+    return Integer::New(data_.size());
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // InitDB
 ////////////////////////////////////////////////////////////////////////////////
@@ -265,7 +434,7 @@ namespace
     }
 
 
-    DEFINE_JS_FUNCTION(QueryCb, args)
+    QueryResult DoQuery(const Arguments& args)
     {
         CheckArgsLength(args, 6);
         Handle<Array> by_values(GetArray(args[2]));
@@ -273,33 +442,65 @@ namespace
         by_strs.reserve(by_values->Length());
         for (size_t i = 0; i < by_values->Length(); ++i)
             by_strs.push_back(Stringify(by_values->Get(Integer::New(i))));
-        Header header;
-        vector<Values> tuples;
-        Query(header,
-              tuples,
-              Stringify(args[0]),
-              ReadParams(args[1]),
-              by_strs,
-              ReadParams(args[3]),
-              args[4]->Uint32Value(),
-              (args[5]->IsUndefined() || args[5]->IsNull()
-               ? MINUS_ONE
-               : args[5]->Uint32Value()));
-        Handle<Array> result(Array::New(tuples.size()));
-        for (size_t tuple_idx = 0; tuple_idx < tuples.size(); ++tuple_idx) {
-            Handle<Object> item(Object::New());
-            const Values& values(tuples[tuple_idx]);
-            AK_ASSERT_EQUAL(values.size(), header.size());
+        return Query(Stringify(args[0]),
+                     ReadParams(args[1]),
+                     by_strs,
+                     ReadParams(args[3]),
+                     args[4]->Uint32Value(),
+                     (args[5]->IsUndefined() || args[5]->IsNull()
+                      ? MINUS_ONE
+                      : args[5]->Uint32Value()));
+    }
+
+
+    DEFINE_JS_FUNCTION(QueryCb, args)
+    {
+        QueryResult query_result(DoQuery(args));
+        const Header& header(query_result.GetHeader());
+        const RowShape& shape(GetRowShape(header));
+        size_t size = query_result.GetSize();
+        Handle<Array> result(Array::New(size));
+        for (size_t tuple_idx = 0; tuple_idx < size; ++tuple_idx) {
+            HandleScope handle_scope;
+            Handle<Object> item(shape.NewRow());
             for (size_t attr_idx = 0; attr_idx < header.size(); ++attr_idx)
-                Set(item,
-                    header[attr_idx].name,
-                    MakeV8Value(values[attr_idx]));
+                item->Set(shape.GetName(attr_idx),
+                          MakeV8Value(query_result,
+                                      tuple_idx,
+                                      attr_idx,
+                                      header[attr_idx].type));
             result->Set(Integer::New(tuple_idx), item);
         }
         return result;
     }
 
 
+    DEFINE_JS_FUNCTION(QueryColumnsCb, args)
+    {
+        QueryResult query_result(DoQuery(args));
+        const Header& header(query_result.GetHeader());
+        size_t size = query_result.GetSize();
+        Handle<Object> result(Object::New());
+        for (size_t attr_idx = 0; attr_idx < header.size(); ++attr_idx) {
+            Type type(header[attr_idx].type);
+            Handle<Object> column;
+            if (type.IsNumeric() || type == Type::DATE) {
+                column = (new NumberColumnBg(query_result, attr_idx))->Wrap();
+            } else {
+                Handle<Array> array(Array::New(size));
+                for (size_t tuple_idx = 0; tuple_idx < size; ++tuple_idx)
+                    array->Set(Integer::New(tuple_idx),
+                               MakeV8Value(
+                                   query_result, tuple_idx, attr_idx, type));
+                column = array;
+            }
+            result->Set(String::NewSymbol(header[attr_idx].name.c_str()),
+                        column);
+        }
+        return result;
+    }
+
+
     DEFINE_JS_FUNCTION(CountCb, args)
     {
         CheckArgsLength(args, 1);
@@ -541,6 +742,7 @@ Handle<Object> ak::InitDB()
     SetFunction(result, "rollback", RollBackCb);
     SetFunction(result, "commit", CommitCb);
     SetFunction(result, "query", QueryCb);
+    SetFunction(result, "queryColumns", QueryColumnsCb);
     SetFunction(result, "count", CountCb);
     SetFunction(result, "create", CreateCb);
     SetFunction(result, "drop", DropCb);
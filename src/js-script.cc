@@ -3,12 +3,209 @@
 #include "js-script.h"
 #include "js-common.h"
 
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fstream>
+#include <iterator>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#include <vector>
+
 
 using namespace ak;
 using namespace v8;
 using namespace std;
 
 
+////////////////////////////////////////////////////////////////////////////////
+// CompileScript
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    // V8 preparse data of a script identified by the git blob SHA-1 of its
+    // source; only sources of the same size are hashed to look it up
+    struct Precompiled {
+        const char* sha;
+        size_t source_size;
+        const unsigned char* data;
+        int size;
+    };
+}
+
+
+// File generated from init.js and lib/*.js by the precompile tool,
+// PRECOMPILED is defined here
+#include "precompiled.h"
+
+
+namespace
+{
+    // Least recently used code cache files are removed beyond this size
+    const off_t MAX_CODE_CACHE_SIZE = 64 << 20;
+
+
+    string code_cache_path;
+
+
+    // Find the precompiled data of the source setting sha to its hash if
+    // it has been computed
+    const Precompiled* FindPrecompiled(const char* source,
+                                       size_t size,
+                                       string& sha)
+    {
+        for (size_t i = 0; i < sizeof(PRECOMPILED) / sizeof(Precompiled); ++i) {
+            if (PRECOMPILED[i].source_size != size)
+                continue;
+            if (sha.empty())
+                sha = HashSource(source, size);
+            if (sha == PRECOMPILED[i].sha)
+                return &PRECOMPILED[i];
+        }
+        return 0;
+    }
+
+
+    // Store the data in the code cache file atomically, so that workers
+    // reading it concurrently see either nothing or the whole file
+    void WriteCodeCache(const string& path, const char* data, int size)
+    {
+        ostringstream oss;
+        oss << path << '.' << getpid();
+        string tmp_path(oss.str());
+        {
+            ofstream file(tmp_path.c_str(), ios::binary);
+            file << V8::GetVersion() << '\n';
+            file.write(data, size);
+            if (!file.good()) {
+                file.close();
+                unlink(tmp_path.c_str());
+                return;
+            }
+        }
+        if (rename(tmp_path.c_str(), path.c_str()))
+            unlink(tmp_path.c_str());
+    }
+
+
+    // Code cache files are named by the source SHA-1 and hold the V8 version
+    // line followed by the preparse data. Return the data of the source from
+    // the cache or make and store it; return 0 for sources with syntax
+    // errors. The result could point into data.
+    ScriptData* ReadCodeCache(const string& sha,
+                              const char* source,
+                              int size,
+                              string& data)
+    {
+        string path(code_cache_path + '/' + sha);
+        ifstream file(path.c_str(), ios::binary);
+        if (file.is_open()) {
+            string version;
+            getline(file, version);
+            if (version == V8::GetVersion()) {
+                data.assign(istreambuf_iterator<char>(file),
+                            istreambuf_iterator<char>());
+                if (!data.empty()) {
+                    // The modification time marks the last use
+                    utime(path.c_str(), 0);
+                    return ScriptData::New(data.data(), data.size());
+                }
+            }
+            file.close();
+        }
+        auto_ptr<ScriptData> script_data_ptr(
+            ScriptData::PreCompile(source, size));
+        if (script_data_ptr->HasError())
+            return 0;
+        WriteCodeCache(
+            path, script_data_ptr->Data(), script_data_ptr->Length());
+        return script_data_ptr.release();
+    }
+
+
+    struct CacheEntry {
+        time_t used;
+        off_t size;
+        string path;
+
+        bool operator<(const CacheEntry& other) const {
+            return used < other.used;
+        }
+    };
+
+
+    // Files of changed sources are never read again, so the least recently
+    // used files are removed once the cache outgrows its limit
+    void PruneCodeCache()
+    {
+        DIR* dir_ptr = opendir(code_cache_path.c_str());
+        if (!dir_ptr)
+            return;
+        vector<CacheEntry> entries;
+        off_t total_size = 0;
+        while (struct dirent* entry_ptr = readdir(dir_ptr)) {
+            if (entry_ptr->d_name[0] == '.')
+                continue;
+            CacheEntry entry;
+            entry.path = code_cache_path + '/' + entry_ptr->d_name;
+            struct stat st;
+            if (stat(entry.path.c_str(), &st) || !S_ISREG(st.st_mode))
+                continue;
+            entry.used = st.st_mtime;
+            entry.size = st.st_size;
+            total_size += st.st_size;
+            entries.push_back(entry);
+        }
+        closedir(dir_ptr);
+        sort(entries.begin(), entries.end());
+        for (size_t i = 0;
+             i < entries.size() && total_size > MAX_CODE_CACHE_SIZE;
+             ++i) {
+            unlink(entries[i].path.c_str());
+            total_size -= entries[i].size;
+        }
+    }
+
+
+    // Create the directory with its missing parents
+    bool MakeDirs(const string& path)
+    {
+        for (size_t idx = path.find('/', 1);; idx = path.find('/', idx + 1)) {
+            if (mkdir(path.substr(0, idx).c_str(), 0755) && errno != EEXIST)
+                return false;
+            if (idx == string::npos)
+                return true;
+        }
+    }
+}
+
+
+Handle<Script> ak::CompileScript(Handle<String> source,
+                                 ScriptOrigin* origin_ptr)
+{
+    String::Utf8Value utf8_value(source);
+    string sha;
+    auto_ptr<ScriptData> script_data_ptr;
+    string data;
+    if (const Precompiled* precompiled_ptr =
+        FindPrecompiled(*utf8_value, utf8_value.length(), sha)) {
+        script_data_ptr.reset(
+            ScriptData::New(
+                reinterpret_cast<const char*>(precompiled_ptr->data),
+                precompiled_ptr->size));
+    } else if (!code_cache_path.empty()) {
+        if (sha.empty())
+            sha = HashSource(*utf8_value, utf8_value.length());
+        script_data_ptr.reset(
+            ReadCodeCache(sha, *utf8_value, utf8_value.length(), data));
+    }
+    return Script::Compile(source, origin_ptr, script_data_ptr.get());
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // ScriptBg
 ////////////////////////////////////////////////////////////////////////////////
@@ -51,7 +248,7 @@ DEFINE_JS_CONSTRUCTOR_CALLBACK(ScriptBg, args)
             new ScriptOrigin(args[1], line_offset, column_offset));
     }
     Handle<Script> script(
-        Script::Compile(args[0]->ToString(), origin_ptr.get()));
+        CompileScript(args[0]->ToString(), origin_ptr.get()));
     if (script.IsEmpty())
         throw Propagate();
     return new ScriptBg(script);
@@ -80,9 +277,17 @@ DEFINE_JS_CALLBACK1(Handle<v8::Value>, ScriptBg, RunCb,
 // InitScript
 ////////////////////////////////////////////////////////////////////////////////
 
-Handle<Object> ak::InitScript()
+Handle<Object> ak::InitScript(const string& code_cache_path)
 {
+    ::code_cache_path = code_cache_path;
+    if (!code_cache_path.empty()) {
+        if (!MakeDirs(code_cache_path))
+            Fail("Failed to create code cache: " + string(strerror(errno)));
+        PruneCodeCache();
+    }
     Handle<Object> result(Object::New());
     PutClass<ScriptBg>(result);
+    Set(result, "moduleHead", String::New(MODULE_HEAD));
+    Set(result, "moduleTail", String::New(MODULE_TAIL));
     return result;
 }
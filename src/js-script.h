@@ -4,11 +4,42 @@
 #define JS_SCRIPT_H
 
 #include <v8.h>
+#include <git2.h>
+
+#include <string>
 
 
 namespace ak
 {
-    v8::Handle<v8::Object> InitScript();
+    // doRequire in init.js wraps module code in a function with these
+    const char MODULE_HEAD[] = "(function (require, exports, module) {\n";
+    const char MODULE_TAIL[] = "\n})";
+
+    // Git blob SHA-1 of the script source in hex, which keys its
+    // precompiled data
+    inline std::string HashSource(const char* data, size_t size)
+    {
+        git_obj obj;
+        obj.data = const_cast<char*>(data);
+        obj.len = size;
+        obj.type = GIT_OBJ_BLOB;
+        git_oid oid;
+        git_obj_hash(&oid, &obj);
+        char hex[40];
+        git_oid_fmt(hex, &oid);
+        return std::string(hex, sizeof(hex));
+    }
+
+    // Compile the script using the precompiled data built in for its source
+    // or, failing that, the data from the code cache, which is filled as
+    // scripts are compiled
+    v8::Handle<v8::Script> CompileScript(v8::Handle<v8::String> source,
+                                         v8::ScriptOrigin* origin_ptr = 0);
+
+    // Empty code_cache_path disables the code cache; the cache directory is
+    // created with its parents and its least recently used files are
+    // removed beyond 64 MB
+    v8::Handle<v8::Object> InitScript(const std::string& code_cache_path);
 }
 
 #endif // JS_SCRIPT_H
@@ -29,14 +29,18 @@ namespace
     public:
         DECLARE_JS_CLASS(SocketBg);
 
-        SocketBg(int fd);
+        SocketBg(int fd, const std::string& prefix, bool offload);
         SocketBg(const std::string& host, const std::string& service);
         ~SocketBg();
 
         void Close();
+        void Detach(std::string& output);
 
     private:
         int fd_;
+        std::string prefix_;
+        bool offload_;
+        std::string output_;
         bool readable_;
         bool writable_;
 
@@ -58,7 +62,7 @@ namespace
                              const v8::Arguments&);
 
         DECLARE_JS_CALLBACK1(v8::Handle<v8::Value>, ReceiveCb,
-                             const v8::Arguments&) const;
+                             const v8::Arguments&);
 
         DECLARE_JS_CALLBACK1(v8::Handle<v8::Value>, SendCb,
                              const v8::Arguments&) const;
@@ -90,8 +94,10 @@ DEFINE_JS_CLASS(SocketBg, "Socket", object_template, proto_template)
 }
 
 
-SocketBg::SocketBg(int fd)
+SocketBg::SocketBg(int fd, const string& prefix, bool offload)
     : fd_(fd)
+    , prefix_(prefix)
+    , offload_(offload)
     , readable_(true)
     , writable_(true)
 {
@@ -100,7 +106,8 @@ SocketBg::SocketBg(int fd)
 
 
 SocketBg::SocketBg(const string& host, const string& service)
-    : readable_(true)
+    : offload_(false)
+    , readable_(true)
     , writable_(true)
 {
     if (open_count >= MAX_OPEN_COUNT)
@@ -110,6 +117,7 @@ SocketBg::SocketBg(const string& host, const string& service)
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     struct addrinfo* first_info_ptr;
+    SpanTimer timer(SOCKET_SPAN);
     if (int ret = getaddrinfo(host.c_str(), service.c_str(),
                               &hints, &first_info_ptr))
         throw Error(Error::SOCKET, gai_strerror(ret));
@@ -139,6 +147,14 @@ SocketBg::~SocketBg()
 void SocketBg::Close()
 {
     if (fd_ != -1) {
+        SpanTimer timer(SOCKET_SPAN);
+        for (size_t sent = 0; sent < output_.size();) {
+            ssize_t count = send(
+                fd_, output_.data() + sent, output_.size() - sent, 0);
+            if (count == -1)
+                break;
+            sent += count;
+        }
         close(fd_);
         fd_ = -1;
         --open_count;
@@ -146,6 +162,17 @@ void SocketBg::Close()
 }
 
 
+void SocketBg::Detach(string& output)
+{
+    output.clear();
+    if (fd_ != -1 && !output_.empty()) {
+        output.swap(output_);
+        fd_ = -1;
+        --open_count;
+    }
+}
+
+
 void SocketBg::CheckOpen() const
 {
     if (fd_ == -1)
@@ -188,14 +215,22 @@ DEFINE_JS_CALLBACK1(Handle<v8::Value>, SocketBg, CloseCb,
 
 
 DEFINE_JS_CALLBACK1(Handle<v8::Value>, SocketBg, ReceiveCb,
-                    const Arguments&, args) const
+                    const Arguments&, args)
 {
     CheckOpen();
     if (!readable_)
         throw Error(Error::VALUE, "Socket is shut down for receiving");
     CheckArgsLength(args, 1);
     size_t size = args[0]->Uint32Value();
+    if (!prefix_.empty()) {
+        size = min(size, prefix_.size());
+        auto_ptr<Chars> data_ptr(
+            new Chars(prefix_.begin(), prefix_.begin() + size));
+        prefix_.erase(0, size);
+        return NewBinary(data_ptr);
+    }
     auto_ptr<Chars> data_ptr(new Chars(size));
+    SpanTimer timer(SOCKET_SPAN);
     ssize_t received = recv(fd_, &data_ptr->front(), size, 0);
     if (received == -1)
         throw Error(Error::SOCKET, strerror(errno));
@@ -212,6 +247,21 @@ DEFINE_JS_CALLBACK1(Handle<v8::Value>, SocketBg, SendCb,
         throw Error(Error::VALUE, "Socket is shut down for sending");
     CheckArgsLength(args, 1);
     Binarizator binarizator(args[0]);
+    SpanTimer timer(SOCKET_SPAN);
+    if (offload_) {
+        // Keep what could not be sent at once for the detacher
+        ssize_t sent = 0;
+        if (output_.empty()) {
+            sent = send(fd_, binarizator.GetData(), binarizator.GetSize(),
+                        MSG_DONTWAIT);
+            if (sent == -1 && errno != EAGAIN)
+                throw Error(Error::SOCKET, strerror(errno));
+            sent = max(sent, static_cast<ssize_t>(0));
+        }
+        output_.append(binarizator.GetData() + sent,
+                       binarizator.GetSize() - sent);
+        return Integer::New(binarizator.GetSize());
+    }
     ssize_t sent = send(fd_, binarizator.GetData(), binarizator.GetSize(), 0);
     if (sent == -1)
         throw Error(Error::SOCKET, strerror(errno));
@@ -229,6 +279,9 @@ DEFINE_JS_CALLBACK1(Handle<v8::Value>, SocketBg, ShutdownCb,
     if (type_name == "send") {
         type = SHUT_WR;
         writable_ = false;
+        // The rest is sent by the detacher which closes the socket anyway
+        if (!output_.empty())
+            return Undefined();
     } else if (type_name == "receive") {
         type = SHUT_RD;
         readable_ = false;
@@ -248,8 +301,8 @@ DEFINE_JS_CALLBACK1(Handle<v8::Value>, SocketBg, ShutdownCb,
 // SocketScope definitions
 ////////////////////////////////////////////////////////////////////////////////
 
-SocketScope::SocketScope(int fd)
-    : socket_(JSNew<SocketBg>(fd))
+SocketScope::SocketScope(int fd, const string& prefix, bool offload)
+    : socket_(JSNew<SocketBg>(fd, prefix, offload))
 {
 }
 
@@ -265,6 +318,12 @@ Handle<Object> SocketScope::GetSocket() const
     return socket_;
 }
 
+
+void SocketScope::Detach(string& output)
+{
+    SocketBg::GetJSClass().Cast(socket_)->Detach(output);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // InitSocket
 ////////////////////////////////////////////////////////////////////////////////
@@ -5,15 +5,24 @@
 
 #include <v8.h>
 
+#include <string>
+
 
 namespace ak
 {
     class SocketScope {
     public:
-        SocketScope(int fd);
+        // Data read from the socket beforehand is received first.
+        // With offload the data the peer is not ready to receive is kept
+        // and could be detached instead of being sent in blocking mode.
+        SocketScope(int fd, const std::string& prefix, bool offload);
         ~SocketScope();
         v8::Handle<v8::Object> GetSocket() const;
 
+        // Take the unsent data; if there is some the socket is left open
+        // and the caller becomes responsible for it
+        void Detach(std::string& output);
+
     private:
         v8::Handle<v8::Object> socket_;
     };
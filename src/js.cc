@@ -31,13 +31,39 @@ using namespace v8;
 
 namespace
 {
-    const int MAX_YOUNG_SPACE_SIZE =   8 * 1024 * 1024;
-    const int MAX_OLD_SPACE_SIZE   = 128 * 1024 * 1024;
-    const int STACK_LIMIT          =   8 * 1024 * 1024;
+    const int STACK_LIMIT = 8 * 1024 * 1024;
 
     Persistent<Context> context;
     Persistent<Object> main_exports;
     jmp_buf environment;
+    GCStats gc_stats;
+    uint64_t gc_start = 0;
+
+
+    // Figures at the start of the request being handled
+    struct RequestStart {
+        uint64_t time;
+        uint64_t span_times[SPAN_COUNT];
+        GCStats gc_stats;
+
+        RequestStart() : time(GetMicroTime()), gc_stats(::gc_stats) {
+            for (int span = 0; span < SPAN_COUNT; ++span)
+                span_times[span] = GetSpanTime(static_cast<Span>(span));
+        }
+    } request_start;
+
+
+    void HandleGCPrologue(GCType /*type*/, GCCallbackFlags /*flags*/)
+    {
+        gc_start = GetMicroTime();
+    }
+
+
+    void HandleGCEpilogue(GCType /*type*/, GCCallbackFlags /*flags*/)
+    {
+        ++gc_stats.count;
+        gc_stats.pause_time += GetMicroTime() - gc_start;
+    }
 
 
     void HandleFatalError(const char* location, const char* message)
@@ -63,10 +89,12 @@ namespace
     }
 
 
+    // With optional a missing function is taken for one returning undefined
     bool Run(const Handle<Object>& holder,
              const string& func_name,
              Handle<v8::Value> arg,
-             string* result_ptr = 0)
+             string* result_ptr = 0,
+             bool optional = false)
     {
         if (setjmp(environment)) {
             if (result_ptr)
@@ -89,7 +117,11 @@ namespace
         }
         if (!main_exports.IsEmpty()) {
             Handle<v8::Value> func_value(Get(holder, func_name));
-            if (func_value.IsEmpty() || !func_value->IsFunction()) {
+            if (optional &&
+                !func_value.IsEmpty() &&
+                func_value->IsUndefined()) {
+                ret = Undefined();
+            } else if (func_value.IsEmpty() || !func_value->IsFunction()) {
                 if (result_ptr)
                     *result_ptr = func_name + " is not a function";
                 return false;
@@ -136,12 +168,20 @@ namespace
 }
 
 
-bool ak::HandleRequest(int conn_fd)
+bool ak::HandleRequest(int conn_fd,
+                       const string& prefix,
+                       string* output_ptr,
+                       string* error_ptr)
 {
+    request_start = RequestStart();
     HandleScope handle_scope;
     Context::Scope context_scope(context);
-    SocketScope socket_scope(conn_fd);
-    return Run(main_exports, "handle", socket_scope.GetSocket());
+    SocketScope socket_scope(conn_fd, prefix, output_ptr != 0);
+    bool result = Run(
+        main_exports, "handle", socket_scope.GetSocket(), error_ptr);
+    if (output_ptr)
+        socket_scope.Detach(*output_ptr);
+    return result;
 }
 
 
@@ -153,43 +193,108 @@ bool ak::EvalExpr(const char* expr, size_t size, string& result)
 }
 
 
+bool ak::WarmUp(string& result)
+{
+    HandleScope handle_scope;
+    Context::Scope context_scope(context);
+    return Run(main_exports, "warmup", Undefined(), &result, true);
+}
+
+
 bool ak::ProgramIsDead()
 {
     return V8::IsDead();
 }
 
 
+size_t ak::GetExternalMemorySize()
+{
+    return V8::AdjustAmountOfExternalAllocatedMemory(0);
+}
+
+
+const GCStats& ak::GetGCStats()
+{
+    return gc_stats;
+}
+
+
+RequestTiming ak::GetRequestTiming()
+{
+    RequestTiming result;
+    result.total = GetMicroTime() - request_start.time;
+    result.translation = (GetSpanTime(TRANSLATION_SPAN) -
+                          request_start.span_times[TRANSLATION_SPAN]);
+    result.db = GetSpanTime(DB_SPAN) - request_start.span_times[DB_SPAN];
+    result.socket = (GetSpanTime(SOCKET_SPAN) -
+                     request_start.span_times[SOCKET_SPAN]);
+    result.gc = gc_stats.pause_time - request_start.gc_stats.pause_time;
+    result.gc_count = gc_stats.count - request_start.gc_stats.count;
+    uint64_t other = result.translation + result.db + result.socket + result.gc;
+    result.js = result.total > other ? result.total - other : 0;
+    return result;
+}
+
+
+bool ak::NotifyIdle()
+{
+    return V8::IdleNotification();
+}
+
+
+void ak::CollectAllGarbage()
+{
+    V8::LowMemoryNotification();
+}
+
+
+size_t ak::GetUsedHeapSize()
+{
+    HeapStatistics heap_statistics;
+    V8::GetHeapStatistics(&heap_statistics);
+    return heap_statistics.used_heap_size();
+}
+
+
 void ak::InitJS(const string& code_path,
                 const string& lib_path,
+                const string& code_cache_path,
                 const GitPathPatterns& git_path_patterns,
                 const string& repo_name,
                 const string& db_options,
                 const string& schema_name,
                 const string& tablespace_name,
                 size_t timeout,
-                bool managed)
+                size_t young_space_size,
+                size_t old_space_size,
+                bool server_timing,
+                bool managed,
+                bool lazy_db)
 {
-    InitDatabase(db_options, schema_name, tablespace_name);
+    InitDatabase(db_options, schema_name, tablespace_name, lazy_db);
 
     V8::SetFatalErrorHandler(HandleFatalError);
 
     ResourceConstraints rc;
-    rc.set_max_young_space_size(MAX_YOUNG_SPACE_SIZE);
-    rc.set_max_old_space_size(MAX_OLD_SPACE_SIZE);
+    rc.set_max_young_space_size(young_space_size);
+    rc.set_max_old_space_size(old_space_size);
     rc.set_stack_limit(ComputeStackLimit(STACK_LIMIT));
     bool ret = v8::SetResourceConstraints(&rc);
     AK_ASSERT(ret);
 
+    V8::AddGCPrologueCallback(HandleGCPrologue);
+    V8::AddGCEpilogueCallback(HandleGCEpilogue);
+
     HandleScope handle_scope;
     context = Context::New();
     Context::Scope context_scope(context);
     Handle<Object> basis(Object::New());
-    Set(basis, "core", InitCore(managed));
+    Set(basis, "core", InitCore(managed, server_timing));
     Set(basis, "db", InitDB());
     Set(basis, "fs", InitFS(code_path, lib_path));
     Set(basis, "binary", InitBinary());
     Set(basis, "proxy", InitProxy());
-    Set(basis, "script", InitScript());
+    Set(basis, "script", InitScript(code_cache_path));
     Set(basis, "socket", InitSocket());
     Set(basis, "http-parser", InitHttpParser());
     if (!git_path_patterns.empty())
@@ -197,9 +302,9 @@ void ak::InitJS(const string& code_path,
     Handle<Array> error_classes(Array::New());
     InitJSCommon(error_classes, timeout);
 
+    ScriptOrigin origin(String::New("native init.js"));
     Handle<Script> script(
-        Script::Compile(String::New(INIT_JS, sizeof(INIT_JS)),
-                        String::New("native init.js")));
+        CompileScript(String::New(INIT_JS, sizeof(INIT_JS)), &origin));
     AK_ASSERT(!script.IsEmpty());
     Handle<v8::Value> init_func_value(script->Run());
     AK_ASSERT(!init_func_value.IsEmpty() && init_func_value->IsFunction());
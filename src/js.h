@@ -5,22 +5,71 @@
 
 #include "common.h"
 
+#include <stdint.h>
+
 
 namespace ak
 {
-    bool HandleRequest(int conn_fd);
+    // Garbage collections since the start of the process
+    struct GCStats {
+        size_t count;
+        uint64_t pause_time; // microseconds
+
+        GCStats() : count(0), pause_time(0) {}
+    };
+
+
+    // Split of the time of the request being handled or handled last,
+    // microseconds; js is what the other layers leave
+    struct RequestTiming {
+        uint64_t total;
+        uint64_t js;
+        uint64_t translation;
+        uint64_t db;
+        uint64_t socket;
+        uint64_t gc;
+        size_t gc_count;
+    };
+
+
+    // With output_ptr the response data the client has not received yet is
+    // stored there and conn_fd is left open if there is some; error_ptr
+    // receives the error message if the request fails
+    bool HandleRequest(int conn_fd,
+                       const std::string& prefix,
+                       std::string* output_ptr,
+                       std::string* error_ptr = 0);
     bool EvalExpr(const char* expr, size_t size, std::string& result);
+    // Require the main module and call its warmup function if it exports one
+    bool WarmUp(std::string& result);
     bool ProgramIsDead();
+    size_t GetUsedHeapSize();
+    const GCStats& GetGCStats();
+    RequestTiming GetRequestTiming();
+
+    // Memory held outside the JS heap by binaries
+    size_t GetExternalMemorySize();
+
+    // Let V8 do some cleanup; return true if it has nothing left to do
+    bool NotifyIdle();
+
+    // Collect all the garbage V8 can
+    void CollectAllGarbage();
 
     void InitJS(const std::string& code_path,
                 const std::string& lib_path,
+                const std::string& code_cache_path,
                 const GitPathPatterns& git_path_patterns,
                 const std::string& repo_name,
                 const std::string& db_options,
                 const std::string& schema_name,
                 const std::string& tablespace_name,
                 size_t timeout,
-                bool managed);
+                size_t young_space_size,
+                size_t old_space_size,
+                bool server_timing,
+                bool managed,
+                bool lazy_db = false);
 }
 
 #endif // JS_H
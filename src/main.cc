@@ -1,15 +1,26 @@
 // (c) 2009-2011 by Anton Korenyushkin
 
 #include "js.h"
+#include "db.h"
+#include "master.h"
+#include "profiler.h"
+#include "scoreboard.h"
+#include "translator.h"
 
 #include <boost/program_options.hpp>
 
+#include <deque>
 #include <fstream>
+#include <arpa/inet.h>
 #include <errno.h>
+#include <iomanip>
 #include <netdb.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 
@@ -21,7 +32,12 @@ namespace po = boost::program_options;
 
 namespace
 {
+    // Expressions of the one-shot eval are cut at this size
     const size_t MAX_EXPR_SIZE = 4096;
+
+    // Larger eval frames are taken for garbage and close the connection
+    const size_t MAX_FRAME_SIZE = 64 << 20;
+    const size_t READ_SIZE = 65536;
     const char* DEFAULT_HOST = "127.0.0.1";
     const char* DEFAULT_PORT = "8000";
 
@@ -42,77 +58,538 @@ namespace
     }
 
 
+    // Resident set size in bytes
+    size_t GetRSS()
+    {
+        ifstream statm("/proc/self/statm");
+        size_t size, resident = 0;
+        statm >> size >> resident;
+        return resident * sysconf(_SC_PAGESIZE);
+    }
+
+
+    // Parse "auto" for all CPUs available to the process or a list like
+    // "0-3,8,10"; return false if the spec is malformed
+    bool ParseCpus(const string& spec, Cpus& cpus)
+    {
+        if (spec == "auto") {
+            cpu_set_t cpu_set;
+            int ret = sched_getaffinity(0, sizeof(cpu_set), &cpu_set);
+            AK_ASSERT_EQUAL(ret, 0);
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                if (CPU_ISSET(cpu, &cpu_set))
+                    cpus.push_back(cpu);
+            return true;
+        }
+        istringstream iss(spec);
+        do {
+            int first, last;
+            if (!(iss >> first) || first < 0 || first >= CPU_SETSIZE)
+                return false;
+            last = first;
+            if (iss.peek() == '-' &&
+                (!iss.ignore() || !(iss >> last) ||
+                 last < first || last >= CPU_SETSIZE))
+                return false;
+            for (int cpu = first; cpu <= last; ++cpu)
+                cpus.push_back(cpu);
+        } while (iss.peek() == ',' && iss.ignore());
+        return iss.eof();
+    }
+
+
+    // Wall clock time in milliseconds
+    int64_t GetWallTime()
+    {
+        struct timeval tv;
+        gettimeofday(&tv, 0);
+        return static_cast<int64_t>(tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+    }
+
+
+    void StartRequest(ScoreboardSlot& slot)
+    {
+        ScoreboardUpdate update(slot);
+        slot.state = BUSY_STATE;
+        slot.request_start = GetWallTime();
+    }
+
+
+    // Only the first line of the error message is kept
+    void FinishRequest(ScoreboardSlot& slot, const string& error)
+    {
+        ScoreboardUpdate update(slot);
+        slot.state = IDLE_STATE;
+        slot.request_start = 0;
+        ++slot.request_count;
+        slot.heap_size = GetUsedHeapSize();
+        slot.external_size = GetExternalMemorySize();
+        slot.gc_count = GetGCStats().count;
+        slot.gc_time = GetGCStats().pause_time;
+        slot.db_time = GetSpanTime(DB_SPAN);
+        TranslationStats translation_stats(GetTranslationStats());
+        slot.translation_hits = translation_stats.hit_count;
+        slot.translation_misses = translation_stats.miss_count;
+        if (!error.empty()) {
+            size_t size = min(error.find('\n'), MAX_ERROR_SIZE - 1);
+            memcpy(slot.last_error, error.data(), size);
+            slot.last_error[size] = 0;
+        }
+    }
+
+
+    // Whether a connection is waiting for the worker or arrives within
+    // timeout milliseconds
+    bool ConnectionIsPending(int server_fd,
+                             int listen_fd,
+                             const deque<int>& queued_fds,
+                             int timeout = 0)
+    {
+        if (!queued_fds.empty())
+            return true;
+        struct pollfd fds[2];
+        fds[0].fd = server_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = listen_fd;
+        fds[1].events = POLLIN;
+        return poll(fds, listen_fd == -1 ? 1 : 2, timeout) > 0;
+    }
+
+
+    // Garbage collection while the worker waits for connections
+    void CollectIdleGarbage(const string& idle_gc,
+                            int server_fd,
+                            int listen_fd,
+                            const deque<int>& queued_fds)
+    {
+        if (idle_gc == "full") {
+            if (!ConnectionIsPending(server_fd, listen_fd, queued_fds))
+                CollectAllGarbage();
+        } else if (idle_gc == "idle") {
+            while (!ConnectionIsPending(server_fd, listen_fd, queued_fds) &&
+                   !NotifyIdle())
+                ;
+        }
+    }
+
+
+    // Memory figures taken at the start and at the end of a request
+    struct RequestStats {
+        size_t heap_size;
+        size_t external_size;
+
+        RequestStats()
+            : heap_size(GetUsedHeapSize())
+            , external_size(GetExternalMemorySize()) {}
+    };
+
+
+    // One line of key=value pairs per request, times are in milliseconds
+    void LogRequest(const RequestStats& start)
+    {
+        RequestStats stop;
+        RequestTiming timing(GetRequestTiming());
+        ostringstream oss;
+        oss << fixed << setprecision(3)
+            << "Request total_ms=" << timing.total / 1000.0
+            << " js_ms=" << timing.js / 1000.0
+            << " translation_ms=" << timing.translation / 1000.0
+            << " db_ms=" << timing.db / 1000.0
+            << " socket_ms=" << timing.socket / 1000.0
+            << " gc_ms=" << timing.gc / 1000.0
+            << " gc_count=" << timing.gc_count
+            << " heap_kb=" << (start.heap_size >> 10)
+            << "->" << (stop.heap_size >> 10)
+            << " external_kb=" << (start.external_size >> 10)
+            << "->" << (stop.external_size >> 10) << '\n';
+        cerr << oss.str();
+    }
+
+
+    bool PrintStatus(const string& scoreboard_path)
+    {
+        ScoreboardSlots slots;
+        if (!ReadScoreboard(scoreboard_path, slots)) {
+            cerr << "Failed to read scoreboard: " << strerror(errno) << '\n';
+            return false;
+        }
+        int64_t now = GetWallTime();
+        cout << left
+             << setw(8) << "PID" << setw(10) << "STATE"
+             << setw(10) << "BUSY_MS" << setw(10) << "REQUESTS"
+             << setw(10) << "HEAP_KB" << setw(10) << "EXT_KB"
+             << setw(10) << "GCS" << setw(10) << "GC_MS"
+             << setw(10) << "DB_MS" << setw(10) << "TR_HIT%"
+             << "LAST_ERROR\n";
+        BOOST_FOREACH(const ScoreboardSlot& slot, slots) {
+            if (!slot.pid)
+                continue;
+            cout << setw(8) << slot.pid
+                 << setw(10) << (slot.state == BUSY_STATE
+                                 ? "busy"
+                                 : slot.state == IDLE_STATE
+                                 ? "idle"
+                                 : slot.state == INCONSISTENT_STATE
+                                 ? "unknown"
+                                 : "starting")
+                 << setw(10) << (slot.request_start
+                                 ? now - slot.request_start
+                                 : 0)
+                 << setw(10) << slot.request_count
+                 << setw(10) << (slot.heap_size >> 10)
+                 << setw(10) << (slot.external_size >> 10)
+                 << setw(10) << slot.gc_count
+                 << setw(10) << slot.gc_time / 1000
+                 << setw(10) << slot.db_time / 1000
+                 << setw(10) << (slot.translation_hits * 100 /
+                                 max<uint64_t>(slot.translation_hits +
+                                               slot.translation_misses,
+                                               1))
+                 << slot.last_error << '\n';
+        }
+        return true;
+    }
+
+
     void HandleStop(int /*signal*/)
     {
         exit(0);
     }
 
 
-    pid_t LaunchWorker(const vector<int>& worker_fds, int listen_fd, int& fd)
+    volatile sig_atomic_t stop_requested = 0;
+
+
+    // Lets a profiling worker write its profile before exiting
+    void HandleWorkerStop(int /*signal*/)
     {
-        int fd_pair[2];
-        int ret = socketpair(AF_UNIX, SOCK_STREAM, 0, fd_pair);
-        AK_ASSERT_EQUAL(ret, 0);
-        pid_t pid = fork();
-        AK_ASSERT(pid != -1);
-        if (pid) {
-            fd = fd_pair[0];
-            close(fd_pair[1]);
-        } else {
-            fd = fd_pair[1];
-            close(fd_pair[0]);
-            close(listen_fd);
-            BOOST_FOREACH(int worker_fd, worker_fds)
-                close(worker_fd);
+        stop_requested = 1;
+    }
+
+
+    volatile sig_atomic_t profile_requested = 0;
+
+
+    void HandleProfile(int /*signal*/)
+    {
+        profile_requested = 1;
+    }
+
+
+    bool ReadFully(int fd, void* buf, size_t size)
+    {
+        for (size_t received = 0; received < size;) {
+            ssize_t count = read(
+                fd, static_cast<char*>(buf) + received, size - received);
+            if (count == -1 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return false;
+            received += count;
         }
-        return pid;
+        return true;
     }
 
 
-    int Serve(int listen_fd, size_t worker_count)
+    bool WriteFully(int fd, const void* buf, size_t size)
     {
-        vector<int> worker_fds;
-        worker_fds.reserve(worker_count);
-        for (size_t i = 0; i < worker_count; ++i) {
-            int fd;
-            if (!LaunchWorker(worker_fds, listen_fd, fd))
-                return fd;
-            worker_fds.push_back(fd);
+        for (size_t sent = 0; sent < size;) {
+            ssize_t count = write(
+                fd, static_cast<const char*>(buf) + sent, size - sent);
+            if (count == -1 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return false;
+            sent += count;
         }
-        for (size_t i = 0;; i = (i + 1) % worker_count) {
-            int conn_fd = accept(listen_fd, 0, 0);
-            AK_ASSERT(conn_fd != -1);
-            struct msghdr msg;
-            msg.msg_name = 0;
-            msg.msg_namelen = 0;
-            char op = 'H';
-            struct iovec iov;
-            iov.iov_base = &op;
-            iov.iov_len = 1;
-            msg.msg_iov = &iov;
-            msg.msg_iovlen = 1;
-            char control[CMSG_SPACE(sizeof(int))];
-            msg.msg_control = control;
-            msg.msg_controllen = sizeof(control);
+        return true;
+    }
+
+
+    // Evaluate the expression read from conn_fd until EOF or MAX_EXPR_SIZE
+    // and send the status byte and the result
+    void ServeEval(int conn_fd)
+    {
+        char expr[MAX_EXPR_SIZE];
+        size_t received = 0;
+        while (received < sizeof(expr)) {
+            ssize_t count = read(
+                conn_fd, expr + received, sizeof(expr) - received);
+            if (count == -1 && errno == EINTR)
+                continue;
+            if (count == -1)
+                return;
+            if (count == 0)
+                break;
+            received += count;
+        }
+        string result;
+        char status = EvalExpr(expr, received, result) ? 'S' : 'F';
+        if (WriteFully(conn_fd, &status, 1))
+            WriteFully(conn_fd, result.data(), result.size());
+    }
+
+
+    // Evaluate expressions framed with a 4-byte big-endian size until EOF.
+    // Each result is sent as the status byte, a 4-byte big-endian size and
+    // the data. Results of pipelined expressions that arrive together are
+    // sent with one write.
+    void ServeEvals(int conn_fd)
+    {
+        string input, output;
+        char buf[READ_SIZE];
+        for (;;) {
+            size_t offset = 0;
+            while (input.size() - offset >= sizeof(uint32_t)) {
+                uint32_t size;
+                memcpy(&size, input.data() + offset, sizeof(size));
+                size = ntohl(size);
+                if (size > MAX_FRAME_SIZE)
+                    return;
+                if (input.size() - offset - sizeof(size) < size)
+                    break;
+                string result;
+                char status = EvalExpr(input.data() + offset + sizeof(size),
+                                       size,
+                                       result) ? 'S' : 'F';
+                offset += sizeof(size) + size;
+                uint32_t result_size = htonl(result.size());
+                output += status;
+                output.append(reinterpret_cast<const char*>(&result_size),
+                              sizeof(result_size));
+                output += result;
+                if (ProgramIsDead())
+                    break;
+            }
+            input.erase(0, offset);
+            if (!output.empty()) {
+                if (!WriteFully(conn_fd, output.data(), output.size()))
+                    return;
+                output.clear();
+            }
+            if (ProgramIsDead())
+                return;
+            ssize_t count = read(conn_fd, buf, sizeof(buf));
+            if (count == -1 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return;
+            input.append(buf, count);
+        }
+    }
+
+
+    // Send the message to the server passing the descriptors with it.
+    // Blocking here cannot deadlock: the master never blocks on writing
+    // to a worker and keeps reading its reports.
+    void SendToServer(int server_fd,
+                      const string& message,
+                      const int* fds,
+                      size_t fd_count)
+    {
+        struct msghdr msg;
+        msg.msg_name = 0;
+        msg.msg_namelen = 0;
+        struct iovec iov;
+        iov.iov_base = const_cast<char*>(message.data());
+        iov.iov_len = message.size();
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        char control[CMSG_SPACE(sizeof(int) * MAX_BATCH_SIZE)];
+        AK_ASSERT(fd_count <= MAX_BATCH_SIZE);
+        msg.msg_control = fd_count ? control : 0;
+        msg.msg_controllen = fd_count ? CMSG_SPACE(sizeof(int) * fd_count) : 0;
+        msg.msg_flags = 0;
+        if (fd_count) {
             struct cmsghdr* cmsg_ptr = CMSG_FIRSTHDR(&msg);
             cmsg_ptr->cmsg_level = SOL_SOCKET;
             cmsg_ptr->cmsg_type = SCM_RIGHTS;
-            cmsg_ptr->cmsg_len = CMSG_LEN(sizeof(int));
-            *reinterpret_cast<int*>(CMSG_DATA(cmsg_ptr)) = conn_fd;
-            ssize_t sent = sendmsg(worker_fds[i], &msg, 0);
-            if (sent != 1) {
-                int fd;
-                if (!LaunchWorker(worker_fds, listen_fd, fd)) {
-                    close(conn_fd);
-                    return fd;
+            cmsg_ptr->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+            memcpy(CMSG_DATA(cmsg_ptr), fds, sizeof(int) * fd_count);
+        }
+        ssize_t sent;
+        do {
+            sent = sendmsg(server_fd, &msg, MSG_NOSIGNAL);
+        } while (sent == -1 && errno == EINTR);
+        while (sent > 0 && static_cast<size_t>(sent) < message.size()) {
+            ssize_t count = send(server_fd,
+                                 message.data() + sent,
+                                 message.size() - sent,
+                                 MSG_NOSIGNAL);
+            if (count == -1 && errno != EINTR)
+                break;
+            if (count > 0)
+                sent += count;
+        }
+    }
+
+
+    // Pass the connection to the server to send the rest of the response
+    void OffloadOutput(int server_fd, int conn_fd, const string& output)
+    {
+        string message(1, WRITE_OP);
+        uint32_t size = output.size();
+        message.append(reinterpret_cast<const char*>(&size), sizeof(size));
+        message += output;
+        SendToServer(server_fd, message, &conn_fd, 1);
+        close(conn_fd);
+    }
+
+
+    // Take the connections waiting in the accept queue of listen_fd
+    void AcceptQueued(int listen_fd, deque<int>& queued_fds)
+    {
+        for (;;) {
+            int conn_fd = accept(listen_fd, 0, 0);
+            if (conn_fd != -1)
+                queued_fds.push_back(conn_fd);
+            else if (errno != EINTR && errno != ECONNABORTED)
+                return;
+        }
+    }
+
+
+    // Receive the next connection with an operation code from the server or,
+    // if listen_fd is valid, accept it. Return false if the server is gone.
+    // The server could pass a batch of connections with one operation code;
+    // the rest of the batch is kept in queued_fds and op retains its value.
+    // A connection passed with 'B' is followed by the request data the
+    // server has read from it, which is stored in prefix.
+    // When the server is gone the connections left in the accept queue of
+    // listen_fd are moved to queued_fds, since closing the socket would
+    // reset them, and listen_fd is closed and set to -1.
+    bool ReceiveConnection(int server_fd,
+                           int& listen_fd,
+                           deque<int>& queued_fds,
+                           char& op,
+                           int& conn_fd,
+                           string& prefix)
+    {
+        prefix.clear();
+        if (stop_requested)
+            return false;
+        if (!queued_fds.empty()) {
+            conn_fd = queued_fds.front();
+            queued_fds.pop_front();
+            return true;
+        }
+        if (listen_fd != -1) {
+            op = 'H';
+            for (;;) {
+                struct pollfd fds[2];
+                fds[0].fd = server_fd;
+                fds[0].events = POLLIN;
+                fds[1].fd = listen_fd;
+                fds[1].events = POLLIN;
+                if (poll(fds, 2, -1) == -1) {
+                    AK_ASSERT_EQUAL(errno, EINTR);
+                    if (stop_requested)
+                        return false;
+                    continue;
                 }
-                close(worker_fds[i]);
-                worker_fds[i] = fd;
-                sent = sendmsg(fd, &msg, 0);
-                AK_ASSERT_EQUAL(sent, 1);
+                if (fds[0].revents) {
+                    AcceptQueued(listen_fd, queued_fds);
+                    close(listen_fd);
+                    listen_fd = -1;
+                    if (queued_fds.empty())
+                        return false;
+                    conn_fd = queued_fds.front();
+                    queued_fds.pop_front();
+                    return true;
+                }
+                conn_fd = accept(listen_fd, 0, 0);
+                if (conn_fd != -1)
+                    return true;
+                AK_ASSERT(errno == EAGAIN ||
+                          errno == EINTR ||
+                          errno == ECONNABORTED);
+            }
+        }
+        struct msghdr msg;
+        msg.msg_name = 0;
+        msg.msg_namelen = 0;
+        struct iovec iov;
+        iov.iov_base = &op;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        char control[CMSG_SPACE(sizeof(int) * MAX_BATCH_SIZE)];
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        // Signals like SIGUSR2 must not end the worker
+        ssize_t received;
+        do {
+            received = recvmsg(server_fd, &msg, 0);
+        } while (received == -1 && errno == EINTR && !stop_requested);
+        if (received != 1)
+            return false;
+        struct cmsghdr* cmsg_ptr = CMSG_FIRSTHDR(&msg);
+        AK_ASSERT(cmsg_ptr && cmsg_ptr->cmsg_type == SCM_RIGHTS);
+        size_t count = (cmsg_ptr->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        AK_ASSERT(count > 0);
+        const int* fd_ptr = reinterpret_cast<const int*>(CMSG_DATA(cmsg_ptr));
+        conn_fd = fd_ptr[0];
+        queued_fds.insert(queued_fds.end(), fd_ptr + 1, fd_ptr + count);
+        if (op == 'B') {
+            uint32_t size;
+            if (!ReadFully(server_fd, &size, sizeof(size)))
+                return false;
+            prefix.resize(size);
+            if (size && !ReadFully(server_fd, &prefix[0], size))
+                return false;
+        }
+        return true;
+    }
+
+
+    // Pass the connections with the request data read from them back to the
+    // server in messages of at most MAX_BATCH_SIZE descriptors
+    void SendReturned(int server_fd,
+                      const vector<int>& conn_fds,
+                      const Strings& prefixes)
+    {
+        size_t idx = 0;
+        do {
+            size_t count = min(conn_fds.size() - idx, MAX_BATCH_SIZE);
+            string message(1, RETURN_OP);
+            uint32_t size = count;
+            message.append(reinterpret_cast<const char*>(&size), sizeof(size));
+            for (size_t i = idx; i < idx + count; ++i) {
+                size = prefixes[i].size();
+                message.append(
+                    reinterpret_cast<const char*>(&size), sizeof(size));
+                message += prefixes[i];
             }
+            SendToServer(server_fd, message, count ? &conn_fds[idx] : 0, count);
+            idx += count;
+        } while (idx < conn_fds.size());
+        BOOST_FOREACH(int conn_fd, conn_fds)
             close(conn_fd);
+    }
+
+
+    // Pass the connections the worker will not handle back to the server.
+    // The server stops passing connections and closes its side of the
+    // socket on getting them; the ones it has sent meanwhile are passed
+    // back too.
+    void ReturnConnections(int server_fd, deque<int>& queued_fds)
+    {
+        vector<int> conn_fds(queued_fds.begin(), queued_fds.end());
+        queued_fds.clear();
+        SendReturned(server_fd, conn_fds, Strings(conn_fds.size()));
+        conn_fds.clear();
+        Strings prefixes;
+        int listen_fd = -1;
+        char op;
+        int conn_fd;
+        string prefix;
+        while (ReceiveConnection(
+                   server_fd, listen_fd, queued_fds, op, conn_fd, prefix)) {
+            conn_fds.push_back(conn_fd);
+            prefixes.push_back(prefix);
         }
+        if (!conn_fds.empty())
+            SendReturned(server_fd, conn_fds, prefixes);
     }
 }
 
@@ -126,17 +603,31 @@ int main(int argc, char** argv)
         ("config,c", po::value<string>(), "config file")
         ;
 
-    string code_path, lib_path;
+    string code_path, lib_path, code_cache_path;
     Strings git_options;
     string repo_name;
     string db_options, schema_name, tablespace_name;
     string log_path;
-    size_t worker_count;
+    string scoreboard_path;
+    string cpu_spec;
+    ServeOptions serve_options;
+    bool zygote;
+    bool warmup;
+    size_t young_space_size, old_space_size;
+    string idle_gc;
+    bool request_log;
+    bool server_timing;
+    string profile_path;
+    size_t profile_every, profile_window;
+    size_t max_request_count, max_heap_size, max_rss;
     size_t timeout;
     po::options_description config_options("Config options");
     config_options.add_options()
         ("app,a", po::value<string>(&code_path), "app code directory")
         ("lib,l", po::value<string>(&lib_path), "lib directory")
+        ("code-cache",
+         po::value<string>(&code_cache_path),
+         "directory of precompiled module data shared between runs")
         ("git,g", po::value<Strings>(&git_options), "git path pattern")
         ("repo,r", po::value<string>(&repo_name), "repository to run")
         ("db,d", po::value<string>(&db_options), "database options")
@@ -147,8 +638,96 @@ int main(int argc, char** argv)
          po::value<string>(&tablespace_name)->default_value("pg_default"),
          "database tablespace")
         ("workers,w",
-         po::value<size_t>(&worker_count)->default_value(5),
-         "serve worker count")
+         po::value<size_t>(&serve_options.worker_count)->default_value(5),
+         "serve initial worker count")
+        ("min-workers",
+         po::value<size_t>(&serve_options.min_worker_count),
+         "serve minimum worker count (default: workers)")
+        ("max-workers",
+         po::value<size_t>(&serve_options.max_worker_count),
+         "serve maximum worker count (default: workers)")
+        ("idle-time",
+         po::value<size_t>(&serve_options.idle_time)->default_value(60),
+         "seconds before an extra idle serve worker is retired")
+        ("pending",
+         po::value<size_t>(
+             &serve_options.max_pending_count)->default_value(100),
+         "serve pending connection limit")
+        ("buffer-requests",
+         po::bool_switch(&serve_options.buffer_requests),
+         "read whole HTTP requests before passing them to serve workers")
+        ("max-header",
+         po::value<size_t>(&serve_options.max_header_size)->default_value(
+             8 * 1024),
+         "buffered request header byte limit")
+        ("max-body",
+         po::value<size_t>(&serve_options.max_body_size)->default_value(
+             1024 * 1024),
+         "buffered request body byte limit")
+        ("offload-writes",
+         po::bool_switch(&serve_options.offload_writes),
+         "let the serve master send responses to slow clients")
+        ("max-wait",
+         po::value<size_t>(&serve_options.max_wait)->default_value(0),
+         "serve pending connection ms before 503 (0 for no limit)")
+        ("shed",
+         po::bool_switch(&serve_options.shed),
+         "answer serve connections over the pending limit with 503")
+        ("batch",
+         po::value<size_t>(&serve_options.batch_size)->default_value(1),
+         "serve connections queued per worker")
+        ("max-requests",
+         po::value<size_t>(&max_request_count)->default_value(0),
+         "requests before a serve worker is recycled (0 for no limit)")
+        ("max-heap",
+         po::value<size_t>(&max_heap_size)->default_value(0),
+         "JS heap MB before a serve worker is recycled (0 for no limit)")
+        ("max-rss",
+         po::value<size_t>(&max_rss)->default_value(0),
+         "resident MB before a serve worker is recycled (0 for no limit)")
+        ("zygote",
+         po::bool_switch(&zygote),
+         "initialize once and fork serve workers ready to run")
+        ("warmup",
+         po::bool_switch(&warmup),
+         "load main and call its warmup() before a serve worker takes "
+         "requests")
+        ("young-space",
+         po::value<size_t>(&young_space_size)->default_value(8),
+         "JS young generation MB")
+        ("old-space",
+         po::value<size_t>(&old_space_size)->default_value(128),
+         "JS old generation MB")
+        ("idle-gc",
+         po::value<string>(&idle_gc)->default_value("none"),
+         "GC between requests: none, idle (V8 idle notifications), or full")
+        ("request-log",
+         po::bool_switch(&request_log),
+         "log request time split and memory use")
+        ("server-timing",
+         po::bool_switch(&server_timing),
+         "report request time split in the Server-Timing header")
+        ("profile",
+         po::value<string>(&profile_path),
+         "file to append collapsed JS CPU profile stacks to")
+        ("profile-every",
+         po::value<size_t>(&profile_every)->default_value(0),
+         "profile one request in this many (0 for none)")
+        ("profile-window",
+         po::value<size_t>(&profile_window)->default_value(10),
+         "seconds a worker profiles after SIGUSR2")
+        ("reuse-port",
+         po::bool_switch(&serve_options.reuse_port),
+         "let each serve worker accept connections itself")
+        ("scoreboard",
+         po::value<string>(&scoreboard_path),
+         "serve worker status file")
+        ("cpus",
+         po::value<string>(&cpu_spec),
+         "CPUs to pin serve workers to round-robin (auto or list like 0-3,8)")
+        ("numa-bind",
+         po::bool_switch(&serve_options.bind_memory),
+         "bind serve worker memory to the NUMA node of its CPU")
         ("log,o", po::value<string>(&log_path), "log file")
         ("background,b", "serve in background")
         ("timeout",
@@ -211,12 +790,19 @@ int main(int argc, char** argv)
             string("Usage: ") +
             argv[0] + " [options] serve [PORT or ADDR:PORT or PATH[:MODE]]\n"
             "       " +
-            argv[0] + " [options] eval  EXPRESSION");
+            argv[0] + " [options] eval  EXPRESSION\n"
+            "       " +
+            argv[0] + " --scoreboard PATH status");
         visible_options.add(generic_options).add(config_options);
         cout << visible_options;
         return !vm.count("help");
     }
 
+    if (command == "status") {
+        RequireOption("scoreboard", scoreboard_path);
+        return PrintStatus(scoreboard_path) ? 0 : 1;
+    }
+
     InitDebug(log_id);
 
     RequireOption("app", code_path);
@@ -228,6 +814,59 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    // Without bounds the pool keeps its initial size
+    if (!vm.count("min-workers"))
+        serve_options.min_worker_count = (
+            vm.count("max-workers")
+            ? min(serve_options.worker_count, serve_options.max_worker_count)
+            : serve_options.worker_count);
+    if (!vm.count("max-workers"))
+        serve_options.max_worker_count = max(serve_options.worker_count,
+                                             serve_options.min_worker_count);
+    if (serve_options.min_worker_count < 1 ||
+        serve_options.min_worker_count > serve_options.max_worker_count) {
+        cerr << "--min-workers must be between 1 and --max-workers\n";
+        return 1;
+    }
+    serve_options.worker_count = max(serve_options.min_worker_count,
+                                     min(serve_options.worker_count,
+                                         serve_options.max_worker_count));
+
+    if (serve_options.buffer_requests && serve_options.reuse_port) {
+        cerr << "--buffer-requests cannot be used with --reuse-port\n";
+        return 1;
+    }
+
+    if (serve_options.batch_size < 1 ||
+        serve_options.batch_size > MAX_BATCH_SIZE) {
+        cerr << "--batch must be between 1 and " << MAX_BATCH_SIZE << '\n';
+        return 1;
+    }
+
+    if (serve_options.max_pending_count < 1) {
+        cerr << "--pending must be at least 1\n";
+        return 1;
+    }
+
+    if (!cpu_spec.empty() && !ParseCpus(cpu_spec, serve_options.cpus)) {
+        cerr << "--cpus must be auto or a list like 0-3,8\n";
+        return 1;
+    }
+    if (serve_options.bind_memory && serve_options.cpus.empty()) {
+        cerr << "--numa-bind must be specified with --cpus\n";
+        return 1;
+    }
+
+    if (idle_gc != "none" && idle_gc != "idle" && idle_gc != "full") {
+        cerr << "--idle-gc must be none, idle, or full\n";
+        return 1;
+    }
+
+    if (warmup && command != "serve") {
+        cerr << "--warmup is only supported by serve\n";
+        return 1;
+    }
+
     GitPathPatterns git_path_patterns;
     BOOST_FOREACH(const string& git_option, git_options) {
         size_t first_idx = git_option.find("%s");
@@ -245,8 +884,22 @@ int main(int argc, char** argv)
                 git_option.substr(second_idx+ 2)));
     }
 
+    // Workers inherit the handler from the master, which ignores the flag
+    if (!profile_path.empty()) {
+        struct sigaction action;
+        action.sa_handler = HandleProfile;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = 0;
+        int ret = sigaction(SIGUSR2, &action, 0);
+        AK_ASSERT_EQUAL(ret, 0);
+    }
+
     pid_t parent_pid = 0;
+    bool served = false;
+    auto_ptr<Scoreboard> scoreboard_ptr;
+    ScoreboardSlot* slot_ptr = 0;
     int server_fd;
+    int listen_fd = -1;
 
     if (command == "serve") {
         string& place(place_or_expr);
@@ -261,10 +914,16 @@ int main(int argc, char** argv)
             AK_ASSERT(curr_path);
             MakePathAbsolute(curr_path, code_path);
             MakePathAbsolute(curr_path, lib_path);
+            if (!code_cache_path.empty())
+                MakePathAbsolute(curr_path, code_cache_path);
             BOOST_FOREACH(GitPathPattern& git_path_pattern, git_path_patterns)
                 MakePathAbsolute(curr_path, git_path_pattern.prefix);
             if (local)
                 MakePathAbsolute(curr_path, place);
+            if (!scoreboard_path.empty())
+                MakePathAbsolute(curr_path, scoreboard_path);
+            if (!profile_path.empty())
+                MakePathAbsolute(curr_path, profile_path);
             free(curr_path);
             pid_t pid = fork();
             AK_ASSERT(pid != -1);
@@ -276,7 +935,6 @@ int main(int argc, char** argv)
             int ret = chdir("/");
             AK_ASSERT_EQUAL(ret, 0);
         }
-        int listen_fd;
         size_t colon_idx = place.find_first_of(':');
         if (local) {
             listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -328,6 +986,13 @@ int main(int argc, char** argv)
                 int ret = setsockopt(
                     listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
                 AK_ASSERT_EQUAL(ret, 0);
+                if (serve_options.reuse_port) {
+                    // Kernels before 3.9 lack the option
+                    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT,
+                                   &yes, sizeof(int)))
+                        Fail(string("--reuse-port is not supported: ") +
+                             strerror(errno));
+                }
                 if (!bind(listen_fd, info_ptr->ai_addr, info_ptr->ai_addrlen))
                     break;
                 close(listen_fd);
@@ -338,8 +1003,11 @@ int main(int argc, char** argv)
             freeaddrinfo(first_info_ptr);
             cout << "Running at " << host << ':' << port << '\n';
         }
-        int ret = listen(listen_fd, SOMAXCONN);
-        AK_ASSERT_EQUAL(ret, 0);
+        // With reuse-port workers listen on their own TCP sockets
+        if (local || !serve_options.reuse_port) {
+            int ret = listen(listen_fd, SOMAXCONN);
+            AK_ASSERT_EQUAL(ret, 0);
+        }
         if (vm.count("background")) {
             FILE* file_ptr = freopen("/dev/null", "w", stdout);
             AK_ASSERT(file_ptr);
@@ -353,15 +1021,37 @@ int main(int argc, char** argv)
         action.sa_handler = HandleStop;
         sigemptyset(&action.sa_mask);
         action.sa_flags = 0;
-        ret = sigaction(SIGTERM, &action, 0);
+        int ret = sigaction(SIGTERM, &action, 0);
         AK_ASSERT_EQUAL(ret, 0);
         ret = sigaction(SIGINT, &action, 0);
         AK_ASSERT_EQUAL(ret, 0);
-        action.sa_handler = SIG_IGN;
-        action.sa_flags = SA_NOCLDWAIT;
-        ret = sigaction(SIGCHLD, &action, 0);
-        AK_ASSERT_EQUAL(ret, 0);
-        server_fd = Serve(listen_fd, worker_count);
+        // Workers forked from an initialized master skip InitJS; the database
+        // is connected lazily so the connection is not shared between them
+        if (zygote)
+            InitJS(code_path,
+                   lib_path,
+                   code_cache_path,
+                   git_path_patterns,
+                   repo_name,
+                   db_options,
+                   schema_name,
+                   tablespace_name,
+                   timeout,
+                   young_space_size << 20,
+                   old_space_size << 20,
+                   server_timing,
+                   false,
+                   true);
+        // Room for the old and new workers during reloads
+        if (!scoreboard_path.empty())
+            scoreboard_ptr.reset(
+                new Scoreboard(scoreboard_path,
+                               4 * serve_options.max_worker_count));
+        serve_options.scoreboard_ptr = scoreboard_ptr.get();
+        server_fd = Serve(listen_fd, serve_options);
+        served = true;
+        if (scoreboard_ptr.get())
+            slot_ptr = scoreboard_ptr->Acquire(getpid());
     } else if (command == "work") {
         parent_pid = getppid();
         server_fd = STDIN_FILENO;
@@ -372,15 +1062,20 @@ int main(int argc, char** argv)
         return 1;
     }
 
-    InitJS(code_path,
-           lib_path,
-           git_path_patterns,
-           repo_name,
-           db_options,
-           schema_name,
-           tablespace_name,
-           timeout,
-           parent_pid);
+    if (!served || !zygote)
+        InitJS(code_path,
+               lib_path,
+               code_cache_path,
+               git_path_patterns,
+               repo_name,
+               db_options,
+               schema_name,
+               tablespace_name,
+               timeout,
+               young_space_size << 20,
+               old_space_size << 20,
+               server_timing,
+               parent_pid);
 
     if (server_fd == -1) {
         const string& expr(place_or_expr);
@@ -390,57 +1085,121 @@ int main(int argc, char** argv)
         return 0;
     }
 
-    do {
-        struct msghdr msg;
-        msg.msg_name = 0;
-        msg.msg_namelen = 0;
-        struct iovec iov;
-        char op;
-        iov.iov_base = &op;
-        iov.iov_len = 1;
-        msg.msg_iov = &iov;
-        msg.msg_iovlen = 1;
-        char control[CMSG_SPACE(sizeof(int))];
-        msg.msg_control = control;
-        msg.msg_controllen = sizeof(control);
-        ssize_t count = recvmsg(server_fd, &msg, 0);
-        if (count != 1)
-            break;
-        struct cmsghdr* cmsg_ptr = CMSG_FIRSTHDR(&msg);
-        int conn_fd = *reinterpret_cast<int*>(CMSG_DATA(cmsg_ptr));
-        if (op == 'H') {
-            HandleRequest(conn_fd); // closes the socket
-        } else {
-            AK_ASSERT_EQUAL(op, 'E');
-            char expr[MAX_EXPR_SIZE];
-            size_t received = 0;
-            do {
-                count = read(
-                    conn_fd, expr + received, MAX_EXPR_SIZE - received);
-                received += count;
-            } while (count > 0);
-            if (count != -1) {
-                string result;
-                char status = EvalExpr(expr, received, result) ? 'S' : 'F';
-                struct iovec iovecs[2];
-                iovecs[0].iov_base = &status;
-                iovecs[0].iov_len = 1;
-                iovecs[1].iov_base = const_cast<char*>(result.data());
-                iovecs[1].iov_len = result.size();
-                count = writev(conn_fd, iovecs, 2);
-                size_t sent = count - 1;
-                while (count > 0 && sent < result.size()) {
-                    count = write(conn_fd,
-                                  result.data() + sent,
-                                  result.size() - sent);
-                    sent += count;
+    if (warmup) {
+        string error;
+        if (!WarmUp(error))
+            cerr << "Warmup failed: " << error << '\n';
+        // A worker killed by warmup is relaunched by the master after a delay
+        if (ProgramIsDead())
+            return 1;
+    }
+
+    if (slot_ptr) {
+        ScoreboardUpdate update(*slot_ptr);
+        slot_ptr->state = IDLE_STATE;
+    }
+
+    if (served) {
+        char report = READY_OP;
+        send(server_fd, &report, 1, MSG_NOSIGNAL);
+    }
+
+    if (!profile_path.empty()) {
+        struct sigaction action;
+        action.sa_handler = HandleWorkerStop;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = 0;
+        int ret = sigaction(SIGTERM, &action, 0);
+        AK_ASSERT_EQUAL(ret, 0);
+        ret = sigaction(SIGINT, &action, 0);
+        AK_ASSERT_EQUAL(ret, 0);
+    }
+
+    deque<int> queued_fds;
+    size_t request_count = 0;
+    bool recycling = false;
+    size_t handled_count = 0;
+    int64_t profile_until = 0;
+    char op;
+    int conn_fd;
+    string prefix;
+    while (ReceiveConnection(
+               server_fd, listen_fd, queued_fds, op, conn_fd, prefix)) {
+        if (op == 'H' || op == 'B') {
+            string output, error;
+            if (!profile_path.empty()) {
+                if (profile_requested) {
+                    profile_requested = 0;
+                    profile_until = GetWallTime() + profile_window * 1000;
+                    StartProfiling();
                 }
+                if (profile_every && ++handled_count % profile_every == 0)
+                    StartProfiling();
             }
+            RequestStats start;
+            if (slot_ptr)
+                StartRequest(*slot_ptr);
+            // Closes the socket unless there is output left to offload
+            if (HandleRequest(conn_fd,
+                              prefix,
+                              (served && serve_options.offload_writes
+                               ? &output
+                               : 0),
+                              slot_ptr ? &error : 0))
+                error.clear();
+            if (!output.empty())
+                OffloadOutput(server_fd, conn_fd, output);
+            // Updated before reporting so the master releases a quiet slot
+            if (slot_ptr)
+                FinishRequest(*slot_ptr, error);
+            if (request_log)
+                LogRequest(start);
+            if (IsProfiling() && GetWallTime() >= profile_until)
+                StopProfiling(profile_path);
+        } else {
+            // 'P' keeps the connection for a stream of framed expressions
+            AK_ASSERT(op == 'E' || op == 'P');
+            if (op == 'E')
+                ServeEval(conn_fd);
+            else
+                ServeEvals(conn_fd);
             close(conn_fd);
         }
-        if (parent_pid)
+        if (parent_pid) {
             kill(parent_pid, SIGRTMIN);
-    } while (!ProgramIsDead());
+        } else if (served && !ProgramIsDead()) {
+            // A dead worker is relaunched by the master when it exits
+            char report[2] = {READY_OP, RECYCLE_OP};
+            ++request_count;
+            bool recycle = (
+                !recycling &&
+                ((max_request_count && request_count >= max_request_count) ||
+                 (max_heap_size && GetUsedHeapSize() >= max_heap_size << 20) ||
+                 (max_rss && GetRSS() >= max_rss << 20)));
+            send(server_fd, report, recycle ? 2 : 1, MSG_NOSIGNAL);
+            recycling = recycling || recycle;
+        }
+        if (ProgramIsDead())
+            break;
+        // Collected after reporting and only until the next connection
+        // arrives, so requests are not delayed by it
+        CollectIdleGarbage(idle_gc, server_fd, listen_fd, queued_fds);
+        // The profile window ends even if no connection arrives in it
+        if (IsProfiling()) {
+            int64_t left = profile_until - GetWallTime();
+            if (left <= 0 ||
+                !ConnectionIsPending(
+                    server_fd, listen_fd, queued_fds, static_cast<int>(left)))
+                StopProfiling(profile_path);
+        }
+    }
+
+    if (IsProfiling())
+        StopProfiling(profile_path);
+
+    // Connections passed by the master go to other workers
+    if (served && !serve_options.reuse_port && ProgramIsDead())
+        ReturnConnections(server_fd, queued_fds);
 
     return 0;
 }
@@ -0,0 +1,1378 @@
+// (c) 2011 by Anton Korenyushkin
+
+#include "master.h"
+#include "scoreboard.h"
+
+#include <algorithm>
+#include <ctype.h>
+#include <deque>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <http_parser.h>
+#include <map>
+#include <sched.h>
+#include <signal.h>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+
+
+using namespace std;
+using namespace ak;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Master
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    const int MAX_EVENT_COUNT = 64;
+    const size_t MAX_REPORT_SIZE = 64 * 1024;
+
+    // Pressure must last this long before another worker is launched
+    const int SCALE_UP_DELAY = 200;
+
+    // Interval of idle worker checks when the pool could shrink
+    const int SCALE_DOWN_INTERVAL = 1000;
+
+    // Share of loaded workers regarded as pressure
+    const size_t BUSY_PERCENT = 80;
+
+    // Limits of connections being read by the master; the count is a share
+    // of the descriptor limit
+    const size_t READING_FD_PERCENT = 25;
+    const int MAX_READING_TIME = 30000;
+
+    // Accepting out of descriptors is retried after this delay unless the
+    // master frees some of its own first
+    const int ACCEPT_RETRY_DELAY = 100;
+
+    // Offloaded response not sent in this time is dropped
+    const int MAX_WRITING_TIME = 60000;
+
+    // Limits of offloaded responses held by the master; the count is a
+    // share of the descriptor limit. The oldest ones are dropped first.
+    const size_t WRITING_FD_PERCENT = 25;
+    const size_t MAX_OUTPUT_SIZE = 256 << 20;
+
+    // A worker exiting before it gets ready is relaunched after a delay
+    // doubling with each failure in a row
+    const int MIN_RELAUNCH_DELAY = 100;
+    const int MAX_RELAUNCH_DELAY = 10000;
+
+    // Responses to connections the master refuses to queue
+    const char SHED_RESPONSE[] =
+        "HTTP/1.0 503 Service Unavailable\r\n"
+        "Retry-After: 1\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: 20\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "Service Unavailable\n";
+
+    const char BAD_REQUEST_RESPONSE[] =
+        "HTTP/1.0 400 Bad Request\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: 12\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "Bad Request\n";
+
+    const char TOO_LARGE_RESPONSE[] =
+        "HTTP/1.0 413 Request Entity Too Large\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: 25\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "Request Entity Too Large\n";
+
+    const char TIMEOUT_RESPONSE[] =
+        "HTTP/1.0 408 Request Timeout\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: 16\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "Request Timeout\n";
+
+
+    volatile sig_atomic_t reload_requested = 0;
+
+
+    void HandleReload(int /*signal*/)
+    {
+        reload_requested = 1;
+    }
+
+
+    volatile sig_atomic_t child_exited = 0;
+
+
+    void HandleChildExit(int /*signal*/)
+    {
+        child_exited = 1;
+    }
+
+
+    // Share of the descriptor limit of the process
+    size_t GetFdShare(size_t percent)
+    {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) ||
+            limit.rlim_cur == RLIM_INFINITY)
+            limit.rlim_cur = 1 << 20;
+        return max(static_cast<size_t>(limit.rlim_cur * percent / 100),
+                   static_cast<size_t>(1));
+    }
+
+
+    // Monotonic time in milliseconds
+    long long GetTime()
+    {
+        struct timespec ts;
+        int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+        AK_ASSERT_EQUAL(ret, 0);
+        return static_cast<long long>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+    }
+
+
+    // Constant of the set_mempolicy system call, which glibc does not wrap
+    const int MPOL_BIND = 2;
+
+
+    // NUMA node of the CPU or -1 if the system has no NUMA information
+    int GetCpuNode(int cpu)
+    {
+        ostringstream oss;
+        oss << "/sys/devices/system/cpu/cpu" << cpu;
+        DIR* dir_ptr = opendir(oss.str().c_str());
+        if (!dir_ptr)
+            return -1;
+        int node = -1;
+        while (struct dirent* entry_ptr = readdir(dir_ptr)) {
+            if (!strncmp(entry_ptr->d_name, "node", 4) &&
+                isdigit(entry_ptr->d_name[4])) {
+                node = atoi(entry_ptr->d_name + 4);
+                break;
+            }
+        }
+        closedir(dir_ptr);
+        return node;
+    }
+
+
+    // Pin the calling process to the CPU and bind its memory to the node
+    void Place(int cpu, int node)
+    {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(cpu, &cpu_set);
+        if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set))
+            cerr << "Failed to pin worker to CPU " << cpu << ": "
+                 << strerror(errno) << '\n';
+        if (node == -1)
+            return;
+        const size_t bit_count = 8 * sizeof(unsigned long);
+        unsigned long node_mask[1024 / bit_count];
+        memset(node_mask, 0, sizeof(node_mask));
+        node_mask[node / bit_count] |= 1UL << (node % bit_count);
+        if (syscall(SYS_set_mempolicy,
+                    MPOL_BIND,
+                    node_mask,
+                    sizeof(node_mask) * 8))
+            cerr << "Failed to bind worker memory to node " << node << ": "
+                 << strerror(errno) << '\n';
+    }
+
+
+    struct Worker {
+        pid_t pid;
+        int fd;
+        bool started;
+        size_t load;
+        long long idle_since;
+        string report;
+        deque<int> passed_fds;
+        bool exiting;
+        string output;
+        bool congested;
+
+        Worker()
+            : pid(0), fd(-1), started(false), load(0), idle_since(0)
+            , exiting(false), congested(false) {}
+    };
+
+
+    typedef vector<Worker> Workers;
+
+
+    struct Connection {
+        int fd;
+        long long accepted;
+        string data;
+
+        Connection(int fd, long long accepted, const string& data)
+            : fd(fd), accepted(accepted), data(data) {}
+    };
+
+
+    // Connection whose request is being read by the master
+    struct Request {
+        long long accepted;
+        string data;
+        http_parser parser;
+        size_t body_size;
+        bool headers_complete;
+        bool complete;
+    };
+
+
+    typedef map<int, Request> Requests;
+
+
+    // Response being sent by the master
+    struct Output {
+        long long started;
+        string data;
+        size_t sent;
+    };
+
+
+    typedef map<int, Output> Outputs;
+
+
+    int OnRequestHeadersComplete(http_parser* p)
+    {
+        static_cast<Request*>(p->data)->headers_complete = true;
+        return 0;
+    }
+
+
+    int OnRequestBody(http_parser* p, const char* /*at*/, size_t size)
+    {
+        static_cast<Request*>(p->data)->body_size += size;
+        return 0;
+    }
+
+
+    int OnRequestComplete(http_parser* p)
+    {
+        static_cast<Request*>(p->data)->complete = true;
+        return 0;
+    }
+
+
+    http_parser_settings CreateRequestSettings()
+    {
+        http_parser_settings settings;
+        memset(&settings, 0, sizeof(settings));
+        settings.on_headers_complete = OnRequestHeadersComplete;
+        settings.on_body             = OnRequestBody;
+        settings.on_message_complete = OnRequestComplete;
+        return settings;
+    }
+
+
+    // Answer with a canned response and close without involving a worker
+    void Refuse(int conn_fd, const char* response)
+    {
+        // Unread data would make close reset the connection
+        char buf[4096];
+        recv(conn_fd, buf, sizeof(buf), MSG_DONTWAIT);
+        send(conn_fd, response, strlen(response), MSG_DONTWAIT | MSG_NOSIGNAL);
+        shutdown(conn_fd, SHUT_WR);
+        close(conn_fd);
+    }
+
+
+    size_t FindWorker(const Workers& workers, int fd)
+    {
+        for (size_t i = 0; i < workers.size(); ++i)
+            if (workers[i].fd == fd)
+                return i;
+        return MINUS_ONE;
+    }
+
+
+    // Dispatches accepted connections to the least loaded workers. Workers
+    // report readiness after initialization and each handled connection by
+    // sending READY_OP back. During bursts the listen queue is drained at
+    // once and up to batch_size connections are passed to a worker in one
+    // message. When all workers are loaded connections wait in a bounded
+    // queue; when the queue is full the master stops accepting and leaves
+    // connections in the listen backlog or, with shed, answers them with
+    // 503 at once. Connections waiting longer than max_wait are shed too.
+    // With buffer_requests a connection is watched by the master until its
+    // HTTP request is complete, so slow clients do not occupy workers; the
+    // request data is passed to the worker along with the connection.
+    // With offload_writes a worker passes a connection back with WRITE_OP
+    // and the response data the client has not received yet, which the
+    // master sends when the connection gets writable.
+    // A worker passing connections back with RETURN_OP is about to exit:
+    // the connections are queued again ahead of the others, the master
+    // closes its side of the socket and drains the worker until it exits,
+    // and the worker is replaced at once.
+    // Nothing is sent to workers in a blocking way: a worker whose socket
+    // is full gets no connections until it has been flushed, and the rest
+    // of a message it has not received is kept in its output.
+    // The pool is resized between min_worker_count and max_worker_count
+    // slots: a worker is added while pending connections or loaded workers
+    // persist and an idle worker is retired after idle_time by closing its
+    // socket, which the worker treats as a request to exit. A worker asking
+    // to be recycled is replaced at once and drained: set aside until its
+    // load drops to zero, then retired the same way.
+    // On SIGHUP a new generation of workers is staged; each staged worker
+    // takes over its slot when it reports readiness and the old one drains.
+    // A worker exiting before it gets ready is relaunched after a delay
+    // growing with each failure in a row, so a failing warmup or broken
+    // code does not make the master fork in a loop.
+    // In the reuse port mode the master only relaunches dead workers; a
+    // recycled worker is replaced through staging as well, so it accepts
+    // until its replacement is ready.
+    class Master {
+    public:
+        Master(int listen_fd, const ServeOptions& options);
+        int Run(int& listen_fd);
+
+    private:
+        int listen_fd_;
+        ServeOptions options_;
+        int epoll_fd_;
+        bool accepting_;
+        size_t max_reading_count_;
+        size_t max_output_count_;
+        size_t output_size_;
+        bool exhausted_;
+        size_t exhausted_count_;
+        long long exhausted_since_;
+        Workers workers_;
+        Workers staged_workers_;
+        Workers drained_workers_;
+        size_t next_idx_;
+        deque<Connection> pending_conns_;
+        Requests requests_;
+        Outputs outputs_;
+        long long pressure_since_;
+        int worker_fd_;
+        sigset_t wait_mask_;
+        vector<size_t> failure_counts_;
+        vector<long long> relaunch_times_;
+
+        bool LaunchWorker(size_t idx);
+        bool Spawn(Worker& worker, size_t idx);
+        void CloseInWorker();
+        int ListenInWorker() const;
+        void Watch(int op, int fd, uint32_t events);
+        void Close(Worker& worker);
+        void Drain(Worker& worker);
+        void Congest(Worker& worker);
+        void WriteWorker(int fd);
+        void HandleWorker(int fd, uint32_t events);
+        size_t FindLeastLoadedWorker(size_t& eligible_count);
+        void Accept();
+        void Enqueue(int conn_fd, long long accepted, const string& data);
+        void ReadRequest(Requests::iterator itr);
+        void DropRequest(Requests::iterator itr, const char* response);
+        int ExpireRequests(int timeout);
+        void StartOutput(int conn_fd, const string& data);
+        void WriteOutput(Outputs::iterator itr);
+        void DropOutput(Outputs::iterator itr);
+        int ExpireOutputs(int timeout);
+        bool TakeReturned(Worker& worker, size_t& pos, bool& lost);
+        bool ReadWorkerReport(Worker& worker, bool& recycle);
+        void ReadReport(int fd);
+        void Reload();
+        void Dispatch();
+        size_t CountHeldFds() const;
+        void UpdateAccepting();
+        int RetryAccepting(int timeout);
+        int Scale();
+        int ShedExpired(int timeout);
+        void Reap();
+        void DelayRelaunch(size_t idx);
+        int RelaunchFailed(int timeout);
+    };
+}
+
+
+Master::Master(int listen_fd, const ServeOptions& options)
+    : listen_fd_(listen_fd)
+    , options_(options)
+    , epoll_fd_(epoll_create(MAX_EVENT_COUNT))
+    , accepting_(true)
+    , max_reading_count_(GetFdShare(READING_FD_PERCENT))
+    , max_output_count_(GetFdShare(WRITING_FD_PERCENT))
+    , output_size_(0)
+    , exhausted_(false)
+    , exhausted_count_(0)
+    , exhausted_since_(0)
+    , next_idx_(0)
+    , pressure_since_(0)
+    , worker_fd_(-1)
+{
+    AK_ASSERT(epoll_fd_ != -1);
+}
+
+
+int Master::Run(int& listen_fd)
+{
+    struct sigaction action;
+    action.sa_handler = HandleReload;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+    int ret = sigaction(SIGHUP, &action, 0);
+    AK_ASSERT_EQUAL(ret, 0);
+    action.sa_handler = HandleChildExit;
+    action.sa_flags = SA_NOCLDSTOP;
+    ret = sigaction(SIGCHLD, &action, 0);
+    AK_ASSERT_EQUAL(ret, 0);
+    // The signals are delivered only while waiting for events, otherwise
+    // they could arrive after the check and wait until the next event
+    sigset_t signal_mask;
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGHUP);
+    sigaddset(&signal_mask, SIGCHLD);
+    ret = sigprocmask(SIG_BLOCK, &signal_mask, &wait_mask_);
+    AK_ASSERT_EQUAL(ret, 0);
+    sigdelset(&wait_mask_, SIGHUP);
+    sigdelset(&wait_mask_, SIGCHLD);
+    workers_.resize(options_.max_worker_count);
+    staged_workers_.resize(options_.max_worker_count);
+    failure_counts_.resize(options_.max_worker_count);
+    relaunch_times_.resize(options_.max_worker_count);
+    for (size_t i = 0; i < options_.worker_count && worker_fd_ == -1; ++i)
+        LaunchWorker(i);
+    if (worker_fd_ == -1 && !options_.reuse_port) {
+        ret = fcntl(
+            listen_fd_, F_SETFL, fcntl(listen_fd_, F_GETFL) | O_NONBLOCK);
+        AK_ASSERT_EQUAL(ret, 0);
+        Watch(EPOLL_CTL_ADD, listen_fd_, EPOLLIN);
+    }
+    struct epoll_event events[MAX_EVENT_COUNT];
+    int timeout = -1;
+    while (worker_fd_ == -1) {
+        if (child_exited) {
+            child_exited = 0;
+            Reap();
+        }
+        if (reload_requested) {
+            reload_requested = 0;
+            Reload();
+            continue;
+        }
+        int count = epoll_pwait(
+            epoll_fd_, events, MAX_EVENT_COUNT, timeout, &wait_mask_);
+        if (count == -1) {
+            AK_ASSERT_EQUAL(errno, EINTR);
+            continue;
+        }
+        for (int i = 0; i < count && worker_fd_ == -1; ++i) {
+            int fd = events[i].data.fd;
+            Requests::iterator request_itr = requests_.find(fd);
+            Outputs::iterator output_itr = outputs_.find(fd);
+            if (fd == listen_fd_)
+                Accept();
+            else if (request_itr != requests_.end())
+                ReadRequest(request_itr);
+            else if (output_itr != outputs_.end())
+                WriteOutput(output_itr);
+            else
+                HandleWorker(fd, events[i].events);
+        }
+        if (worker_fd_ == -1)
+            Dispatch();
+        if (worker_fd_ == -1)
+            UpdateAccepting();
+        if (worker_fd_ == -1)
+            timeout = Scale();
+        if (worker_fd_ == -1)
+            timeout = ShedExpired(timeout);
+        if (worker_fd_ == -1)
+            timeout = ExpireRequests(timeout);
+        if (worker_fd_ == -1)
+            timeout = ExpireOutputs(timeout);
+        if (worker_fd_ == -1)
+            timeout = RelaunchFailed(timeout);
+        if (worker_fd_ == -1)
+            timeout = RetryAccepting(timeout);
+    }
+    listen_fd = options_.reuse_port ? ListenInWorker() : -1;
+    return worker_fd_;
+}
+
+
+bool Master::LaunchWorker(size_t idx)
+{
+    Worker& worker(workers_[idx]);
+    if (worker.fd != -1)
+        Close(worker);
+    return Spawn(worker, idx);
+}
+
+
+bool Master::Spawn(Worker& worker, size_t idx)
+{
+    int cpu = -1, node = -1;
+    if (!options_.cpus.empty()) {
+        cpu = options_.cpus[idx % options_.cpus.size()];
+        if (options_.bind_memory)
+            node = GetCpuNode(cpu);
+    }
+    int fd_pair[2];
+    int ret = socketpair(AF_UNIX, SOCK_STREAM, 0, fd_pair);
+    AK_ASSERT_EQUAL(ret, 0);
+    pid_t pid = fork();
+    AK_ASSERT(pid != -1);
+    if (!pid) {
+        worker_fd_ = fd_pair[1];
+        close(fd_pair[0]);
+        CloseInWorker();
+        if (cpu != -1)
+            Place(cpu, node);
+        return true;
+    }
+    if (cpu != -1) {
+        cerr << "Worker " << pid << " in slot " << idx << " runs on CPU "
+             << cpu;
+        if (node != -1)
+            cerr << ", memory on node " << node;
+        cerr << '\n';
+    }
+    close(fd_pair[1]);
+    worker.pid = pid;
+    worker.fd = fd_pair[0];
+    worker.started = false;
+    worker.load = 0;
+    worker.idle_since = GetTime();
+    Watch(EPOLL_CTL_ADD, worker.fd, EPOLLIN);
+    return false;
+}
+
+
+void Master::CloseInWorker()
+{
+    struct sigaction action;
+    action.sa_handler = SIG_IGN;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+    int ret = sigaction(SIGHUP, &action, 0);
+    AK_ASSERT_EQUAL(ret, 0);
+    action.sa_handler = SIG_DFL;
+    ret = sigaction(SIGCHLD, &action, 0);
+    AK_ASSERT_EQUAL(ret, 0);
+    ret = sigprocmask(SIG_SETMASK, &wait_mask_, 0);
+    AK_ASSERT_EQUAL(ret, 0);
+    if (!options_.reuse_port)
+        close(listen_fd_);
+    close(epoll_fd_);
+    Workers all_workers(workers_);
+    all_workers.insert(
+        all_workers.end(), staged_workers_.begin(), staged_workers_.end());
+    all_workers.insert(
+        all_workers.end(), drained_workers_.begin(), drained_workers_.end());
+    BOOST_FOREACH(const Worker& worker, all_workers) {
+        if (worker.fd != -1)
+            close(worker.fd);
+        BOOST_FOREACH(int conn_fd, worker.passed_fds)
+            close(conn_fd);
+    }
+    BOOST_FOREACH(const Connection& conn, pending_conns_)
+        close(conn.fd);
+    BOOST_FOREACH(const Requests::value_type& value, requests_)
+        close(value.first);
+    BOOST_FOREACH(const Outputs::value_type& value, outputs_)
+        close(value.first);
+}
+
+
+int Master::ListenInWorker() const
+{
+    struct sockaddr_storage address;
+    socklen_t size = sizeof(address);
+    int ret = getsockname(
+        listen_fd_, reinterpret_cast<struct sockaddr*>(&address), &size);
+    AK_ASSERT_EQUAL(ret, 0);
+    int result = listen_fd_;
+    if (address.ss_family != AF_UNIX) {
+        result = socket(address.ss_family, SOCK_STREAM, 0);
+        AK_ASSERT(result != -1);
+        int yes = 1;
+        ret = setsockopt(result, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+        AK_ASSERT_EQUAL(ret, 0);
+        ret = setsockopt(result, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+        AK_ASSERT_EQUAL(ret, 0);
+        if (bind(result, reinterpret_cast<struct sockaddr*>(&address), size))
+            Fail(strerror(errno));
+        ret = listen(result, SOMAXCONN);
+        AK_ASSERT_EQUAL(ret, 0);
+        close(listen_fd_);
+    }
+    // Other workers could take a connection between poll and accept
+    ret = fcntl(result, F_SETFL, fcntl(result, F_GETFL) | O_NONBLOCK);
+    AK_ASSERT_EQUAL(ret, 0);
+    return result;
+}
+
+
+void Master::Watch(int op, int fd, uint32_t events)
+{
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = fd;
+    int ret = epoll_ctl(epoll_fd_, op, fd, &event);
+    AK_ASSERT_EQUAL(ret, 0);
+}
+
+
+void Master::Close(Worker& worker)
+{
+    Watch(EPOLL_CTL_DEL, worker.fd, 0);
+    close(worker.fd);
+    BOOST_FOREACH(int conn_fd, worker.passed_fds)
+        close(conn_fd);
+    worker = Worker();
+}
+
+
+void Master::Drain(Worker& worker)
+{
+    if (worker.load) {
+        drained_workers_.push_back(worker);
+        worker = Worker();
+    } else {
+        Close(worker);
+    }
+}
+
+
+void Master::Congest(Worker& worker)
+{
+    worker.congested = true;
+    Watch(EPOLL_CTL_MOD, worker.fd, EPOLLIN | EPOLLOUT);
+}
+
+
+void Master::WriteWorker(int fd)
+{
+    Workers* lists[] = {&workers_, &staged_workers_, &drained_workers_};
+    Worker* worker_ptr = 0;
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); ++i) {
+        size_t idx = FindWorker(*lists[i], fd);
+        if (idx != MINUS_ONE) {
+            worker_ptr = &(*lists[i])[idx];
+            break;
+        }
+    }
+    if (!worker_ptr)
+        return;
+    Worker& worker(*worker_ptr);
+    while (!worker.output.empty()) {
+        ssize_t sent = send(worker.fd,
+                            worker.output.data(),
+                            worker.output.size(),
+                            MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent == -1 && errno == EAGAIN)
+            return;
+        if (sent == -1 && errno != EINTR) {
+            // The worker is gone and would be relaunched on reading
+            worker.output.clear();
+            break;
+        }
+        if (sent > 0)
+            worker.output.erase(0, sent);
+    }
+    worker.congested = false;
+    Watch(EPOLL_CTL_MOD, worker.fd, EPOLLIN);
+    if (worker.exiting)
+        shutdown(worker.fd, SHUT_WR);
+}
+
+
+void Master::HandleWorker(int fd, uint32_t events)
+{
+    if (events & EPOLLOUT)
+        WriteWorker(fd);
+    if (events & ~EPOLLOUT)
+        ReadReport(fd);
+}
+
+
+size_t Master::FindLeastLoadedWorker(size_t& eligible_count)
+{
+    size_t result = MINUS_ONE;
+    eligible_count = 0;
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        size_t idx = (next_idx_ + i) % workers_.size();
+        const Worker& worker(workers_[idx]);
+        if (worker.started &&
+            !worker.congested &&
+            worker.load < options_.batch_size) {
+            ++eligible_count;
+            if (result == MINUS_ONE || worker.load < workers_[result].load)
+                result = idx;
+        }
+    }
+    if (result != MINUS_ONE)
+        next_idx_ = (result + 1) % workers_.size();
+    return result;
+}
+
+
+void Master::Accept()
+{
+    long long now = GetTime();
+    while (options_.buffer_requests
+           ? requests_.size() < max_reading_count_
+           : (options_.shed ||
+              pending_conns_.size() < options_.max_pending_count)) {
+        int conn_fd = accept(listen_fd_, 0, 0);
+        if (conn_fd == -1 &&
+            (errno == EMFILE ||
+             errno == ENFILE ||
+             errno == ENOBUFS ||
+             errno == ENOMEM)) {
+            // Connections stay in the backlog until descriptors are freed
+            if (!exhausted_)
+                cerr << "Failed to accept: " << strerror(errno) << '\n';
+            exhausted_ = true;
+            exhausted_count_ = CountHeldFds();
+            exhausted_since_ = now;
+            return;
+        }
+        if (conn_fd == -1) {
+            AK_ASSERT(errno == EAGAIN ||
+                      errno == EWOULDBLOCK ||
+                      errno == EINTR ||
+                      errno == ECONNABORTED);
+            return;
+        }
+        if (!options_.buffer_requests) {
+            Enqueue(conn_fd, now, "");
+            if (worker_fd_ != -1)
+                return;
+            continue;
+        }
+        int ret = fcntl(conn_fd, F_SETFL, fcntl(conn_fd, F_GETFL) | O_NONBLOCK);
+        AK_ASSERT_EQUAL(ret, 0);
+        Request& request(requests_[conn_fd]);
+        request.accepted = now;
+        request.body_size = 0;
+        request.headers_complete = false;
+        request.complete = false;
+        http_parser_init(&request.parser, HTTP_REQUEST);
+        request.parser.data = &request;
+        Watch(EPOLL_CTL_ADD, conn_fd, EPOLLIN);
+    }
+}
+
+
+void Master::Enqueue(int conn_fd, long long accepted, const string& data)
+{
+    // Workers could have got ready since the burst began
+    if (pending_conns_.size() >= options_.max_pending_count)
+        Dispatch();
+    if (worker_fd_ != -1) {
+        close(conn_fd);
+        return;
+    }
+    // Complete requests are queued over the limit unless they could be shed
+    if (pending_conns_.size() < options_.max_pending_count || !options_.shed)
+        pending_conns_.push_back(Connection(conn_fd, accepted, data));
+    else
+        Refuse(conn_fd, SHED_RESPONSE);
+}
+
+
+void Master::ReadRequest(Requests::iterator itr)
+{
+    static http_parser_settings settings(CreateRequestSettings());
+    int conn_fd = itr->first;
+    Request& request(itr->second);
+    char buf[8192];
+    ssize_t count = recv(conn_fd, buf, sizeof(buf), 0);
+    if (count == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (count <= 0) {
+        DropRequest(itr, 0);
+        return;
+    }
+    request.data.append(buf, count);
+    size_t parsed = http_parser_execute(
+        &request.parser, &settings, buf, count);
+    if (parsed != static_cast<size_t>(count)) {
+        DropRequest(itr, BAD_REQUEST_RESPONSE);
+    } else if ((!request.headers_complete &&
+                request.data.size() > options_.max_header_size) ||
+               request.body_size > options_.max_body_size) {
+        DropRequest(itr, TOO_LARGE_RESPONSE);
+    } else if (request.complete) {
+        Watch(EPOLL_CTL_DEL, conn_fd, 0);
+        int ret = fcntl(
+            conn_fd, F_SETFL, fcntl(conn_fd, F_GETFL) & ~O_NONBLOCK);
+        AK_ASSERT_EQUAL(ret, 0);
+        // The wait for a worker starts when the request is complete
+        string data;
+        data.swap(request.data);
+        requests_.erase(itr);
+        Enqueue(conn_fd, GetTime(), data);
+    }
+}
+
+
+void Master::DropRequest(Requests::iterator itr, const char* response)
+{
+    int conn_fd = itr->first;
+    requests_.erase(itr);
+    Watch(EPOLL_CTL_DEL, conn_fd, 0);
+    if (response)
+        Refuse(conn_fd, response);
+    else
+        close(conn_fd);
+}
+
+
+// Queue the connections of a complete RETURN_OP message at pos and advance
+// pos past it; return false if the message has not arrived completely or
+// set lost if the descriptors have not arrived with it
+bool Master::TakeReturned(Worker& worker, size_t& pos, bool& lost)
+{
+    const string& report(worker.report);
+    uint32_t count;
+    size_t end = pos + 1 + sizeof(count);
+    if (report.size() < end)
+        return false;
+    memcpy(&count, report.data() + pos + 1, sizeof(count));
+    Strings data_list;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t size;
+        if (report.size() < end + sizeof(size))
+            return false;
+        memcpy(&size, report.data() + end, sizeof(size));
+        end += sizeof(size);
+        if (report.size() < end + size)
+            return false;
+        data_list.push_back(report.substr(end, size));
+        end += size;
+    }
+    if (worker.passed_fds.size() < count) {
+        lost = true;
+        return false;
+    }
+    long long now = GetTime();
+    for (size_t i = count; i > 0; --i)
+        pending_conns_.push_front(
+            Connection(worker.passed_fds[i - 1], now, data_list[i - 1]));
+    worker.passed_fds.erase(worker.passed_fds.begin(),
+                            worker.passed_fds.begin() + count);
+    worker.load -= min<size_t>(worker.load, count);
+    // The worker passes back whatever it receives until the socket closes;
+    // the rest of a message is flushed first
+    if (!worker.exiting) {
+        worker.exiting = true;
+        if (worker.output.empty())
+            shutdown(worker.fd, SHUT_WR);
+    }
+    pos = end;
+    return true;
+}
+
+
+bool Master::ReadWorkerReport(Worker& worker, bool& recycle)
+{
+    recycle = false;
+    static char buf[MAX_REPORT_SIZE];
+    struct msghdr msg;
+    msg.msg_name = 0;
+    msg.msg_namelen = 0;
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(int) * MAX_BATCH_SIZE)];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    msg.msg_flags = 0;
+    ssize_t count = recvmsg(worker.fd, &msg, MSG_DONTWAIT);
+    if (count == -1)
+        return errno == EAGAIN || errno == EINTR;
+    if (count == 0)
+        return false;
+    // Descriptors dropped by the kernel, for example at the descriptor
+    // limit, would leave the reports unmatched
+    bool lost = (msg.msg_flags & MSG_CTRUNC) != 0;
+    for (struct cmsghdr* cmsg_ptr = CMSG_FIRSTHDR(&msg);
+         cmsg_ptr;
+         cmsg_ptr = CMSG_NXTHDR(&msg, cmsg_ptr)) {
+        if (cmsg_ptr->cmsg_level != SOL_SOCKET ||
+            cmsg_ptr->cmsg_type != SCM_RIGHTS)
+            continue;
+        const int* fd_ptr = reinterpret_cast<const int*>(CMSG_DATA(cmsg_ptr));
+        size_t fd_count = (cmsg_ptr->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        worker.passed_fds.insert(
+            worker.passed_fds.end(), fd_ptr, fd_ptr + fd_count);
+    }
+    // A write operation could arrive in parts
+    worker.report.append(buf, count);
+    size_t ready_count = 0;
+    size_t pos = 0;
+    while (!lost && pos < worker.report.size()) {
+        char op = worker.report[pos];
+        if (op == READY_OP) {
+            ++ready_count;
+            ++pos;
+        } else if (op == RECYCLE_OP) {
+            recycle = true;
+            ++pos;
+        } else if (op == RETURN_OP) {
+            if (!TakeReturned(worker, pos, lost))
+                break;
+        } else {
+            AK_ASSERT_EQUAL(op, WRITE_OP);
+            uint32_t size;
+            if (worker.report.size() - pos < 1 + sizeof(size))
+                break;
+            memcpy(&size, worker.report.data() + pos + 1, sizeof(size));
+            if (worker.report.size() - pos < 1 + sizeof(size) + size)
+                break;
+            if (worker.passed_fds.empty()) {
+                lost = true;
+                break;
+            }
+            StartOutput(worker.passed_fds.front(),
+                        worker.report.substr(pos + 1 + sizeof(size), size));
+            worker.passed_fds.pop_front();
+            pos += 1 + sizeof(size) + size;
+        }
+    }
+    if (lost) {
+        // The worker is replaced and the connections passed by it closed
+        cerr << "Connections passed by worker " << worker.pid
+             << " got lost, dropping them\n";
+        return false;
+    }
+    worker.report.erase(0, pos);
+    if (!worker.started && ready_count) {
+        worker.started = true;
+        --ready_count;
+    }
+    worker.load -= min(worker.load, ready_count);
+    if (!worker.load)
+        worker.idle_since = GetTime();
+    return true;
+}
+
+
+void Master::ReadReport(int fd)
+{
+    // The descriptor could be closed and reused while handling earlier events
+    bool recycle;
+    size_t idx = FindWorker(workers_, fd);
+    if (idx != MINUS_ONE) {
+        Worker& worker(workers_[idx]);
+        if (!ReadWorkerReport(worker, recycle)) {
+            // A worker failing to start is not relaunched at once
+            if (worker.started)
+                LaunchWorker(idx);
+            else
+                DelayRelaunch(idx);
+            return;
+        }
+        if (worker.started)
+            failure_counts_[idx] = 0;
+        if (worker.exiting) {
+            drained_workers_.push_back(worker);
+            worker = Worker();
+            LaunchWorker(idx);
+        } else if (recycle) {
+            // Its accept queue must stay open until the replacement listens
+            if (!options_.reuse_port) {
+                Drain(worker);
+                LaunchWorker(idx);
+            } else if (staged_workers_[idx].fd == -1) {
+                Spawn(staged_workers_[idx], idx);
+            }
+        }
+        return;
+    }
+    idx = FindWorker(staged_workers_, fd);
+    if (idx != MINUS_ONE) {
+        Worker& worker(staged_workers_[idx]);
+        if (!ReadWorkerReport(worker, recycle)) {
+            // Keep the old worker if the new one fails to start
+            Close(worker);
+            cerr << "Replacement worker exited before getting ready\n";
+        } else if (worker.started) {
+            Drain(workers_[idx]);
+            workers_[idx] = worker;
+            worker = Worker();
+        }
+        return;
+    }
+    idx = FindWorker(drained_workers_, fd);
+    if (idx != MINUS_ONE) {
+        Worker& worker(drained_workers_[idx]);
+        if (!ReadWorkerReport(worker, recycle) ||
+            (!worker.load && !worker.exiting)) {
+            Close(worker);
+            drained_workers_.erase(drained_workers_.begin() + idx);
+        }
+    }
+}
+
+
+void Master::Reload()
+{
+    for (size_t idx = 0; idx < workers_.size() && worker_fd_ == -1; ++idx) {
+        if (staged_workers_[idx].fd != -1)
+            Close(staged_workers_[idx]);
+        if (workers_[idx].fd != -1)
+            Spawn(staged_workers_[idx], idx);
+    }
+}
+
+
+// The scoreboard slot of a worker is released only when it has exited, so
+// the worker could not be updating it meanwhile
+void Master::Reap()
+{
+    pid_t pid;
+    while ((pid = waitpid(-1, 0, WNOHANG)) > 0)
+        if (options_.scoreboard_ptr)
+            options_.scoreboard_ptr->Release(pid);
+}
+
+
+void Master::Dispatch()
+{
+    while (!pending_conns_.empty()) {
+        size_t eligible_count;
+        size_t idx = FindLeastLoadedWorker(eligible_count);
+        if (idx == MINUS_ONE)
+            return;
+        // Share the burst between the workers able to take connections
+        size_t count = min(min(pending_conns_.size(),
+                               options_.batch_size - workers_[idx].load),
+                           max(static_cast<size_t>(1),
+                               pending_conns_.size() / eligible_count));
+        // Buffered requests are passed one by one followed by their data
+        string message(1, 'H');
+        if (options_.buffer_requests) {
+            count = 1;
+            const string& data(pending_conns_.front().data);
+            uint32_t size = data.size();
+            message[0] = 'B';
+            message.append(reinterpret_cast<const char*>(&size), sizeof(size));
+            message += data;
+        }
+        struct msghdr msg;
+        msg.msg_name = 0;
+        msg.msg_namelen = 0;
+        struct iovec iov;
+        iov.iov_base = const_cast<char*>(message.data());
+        iov.iov_len = message.size();
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        char control[CMSG_SPACE(sizeof(int) * MAX_BATCH_SIZE)];
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        msg.msg_flags = 0;
+        struct cmsghdr* cmsg_ptr = CMSG_FIRSTHDR(&msg);
+        cmsg_ptr->cmsg_level = SOL_SOCKET;
+        cmsg_ptr->cmsg_type = SCM_RIGHTS;
+        cmsg_ptr->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        int* conn_fd_ptr = reinterpret_cast<int*>(CMSG_DATA(cmsg_ptr));
+        for (size_t i = 0; i < count; ++i)
+            conn_fd_ptr[i] = pending_conns_[i].fd;
+        Worker& worker(workers_[idx]);
+        ssize_t sent = sendmsg(
+            worker.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && errno == EAGAIN) {
+            // The connections wait for another worker
+            Congest(worker);
+            continue;
+        }
+        if (sent <= 0) {
+            // The relaunched worker gets connections once it is ready
+            if (LaunchWorker(idx))
+                return;
+            continue;
+        }
+        // The descriptors have gone with the first part of the message
+        if (static_cast<size_t>(sent) < message.size()) {
+            worker.output = message.substr(sent);
+            Congest(worker);
+        }
+        worker.load += count;
+        for (size_t i = 0; i < count; ++i) {
+            close(pending_conns_.front().fd);
+            pending_conns_.pop_front();
+        }
+    }
+}
+
+
+// Number of client connections the master holds
+size_t Master::CountHeldFds() const
+{
+    return pending_conns_.size() + requests_.size() + outputs_.size();
+}
+
+
+void Master::UpdateAccepting()
+{
+    // Workers accept on their own sockets in the reuse port mode
+    if (options_.reuse_port)
+        return;
+    if (exhausted_ && CountHeldFds() < exhausted_count_)
+        exhausted_ = false;
+    bool accepting = (!exhausted_ &&
+                      (options_.buffer_requests
+                       ? requests_.size() < max_reading_count_
+                       : (options_.shed ||
+                          pending_conns_.size() <
+                          options_.max_pending_count)));
+    if (accepting != accepting_) {
+        Watch(EPOLL_CTL_MOD, listen_fd_, accepting ? EPOLLIN : 0u);
+        accepting_ = accepting;
+    }
+}
+
+
+int Master::RetryAccepting(int timeout)
+{
+    if (!exhausted_)
+        return timeout;
+    long long now = GetTime();
+    if (now - exhausted_since_ >= ACCEPT_RETRY_DELAY) {
+        exhausted_ = false;
+        UpdateAccepting();
+        return timeout;
+    }
+    int rest = static_cast<int>(exhausted_since_ + ACCEPT_RETRY_DELAY - now);
+    return timeout == -1 || timeout > rest ? rest : timeout;
+}
+
+
+int Master::Scale()
+{
+    if (options_.reuse_port)
+        return -1;
+    long long now = GetTime();
+    size_t running_count = 0, busy_count = 0;
+    bool starting = false;
+    BOOST_FOREACH(const Worker& worker, workers_) {
+        if (worker.fd != -1) {
+            ++running_count;
+            if (!worker.started)
+                starting = true;
+            else if (worker.load)
+                ++busy_count;
+        }
+    }
+    int timeout = -1;
+    // Workers being started are expected to relieve the pressure
+    if (!starting &&
+        (!pending_conns_.empty() ||
+         busy_count * 100 >= running_count * BUSY_PERCENT)) {
+        if (!pressure_since_) {
+            pressure_since_ = now;
+        } else if (now - pressure_since_ >= SCALE_UP_DELAY &&
+                   running_count < workers_.size()) {
+            for (size_t idx = 0; idx < workers_.size(); ++idx) {
+                if (workers_[idx].fd == -1 && !relaunch_times_[idx]) {
+                    if (LaunchWorker(idx))
+                        return -1;
+                    ++running_count;
+                    pressure_since_ = now;
+                    break;
+                }
+            }
+        }
+        if (running_count < workers_.size())
+            timeout = SCALE_UP_DELAY;
+    } else {
+        pressure_since_ = 0;
+    }
+    if (running_count > options_.min_worker_count) {
+        long long idle_time = static_cast<long long>(options_.idle_time) * 1000;
+        for (size_t idx = 0; idx < workers_.size(); ++idx) {
+            const Worker& worker(workers_[idx]);
+            if (worker.fd != -1 &&
+                worker.started &&
+                !worker.load &&
+                staged_workers_[idx].fd == -1 &&
+                now - worker.idle_since >= idle_time) {
+                Close(workers_[idx]);
+                --running_count;
+                break;
+            }
+        }
+        if (running_count > options_.min_worker_count &&
+            (timeout == -1 || timeout > SCALE_DOWN_INTERVAL))
+            timeout = SCALE_DOWN_INTERVAL;
+    }
+    return timeout;
+}
+
+
+int Master::ShedExpired(int timeout)
+{
+    if (!options_.max_wait)
+        return timeout;
+    long long now = GetTime();
+    long long max_wait = options_.max_wait;
+    while (!pending_conns_.empty() &&
+           now - pending_conns_.front().accepted >= max_wait) {
+        Refuse(pending_conns_.front().fd, SHED_RESPONSE);
+        pending_conns_.pop_front();
+    }
+    if (pending_conns_.empty())
+        return timeout;
+    int rest = static_cast<int>(
+        pending_conns_.front().accepted + max_wait - now);
+    return timeout == -1 || timeout > rest ? rest : timeout;
+}
+
+
+int Master::ExpireRequests(int timeout)
+{
+    long long now = GetTime();
+    long long oldest = now;
+    for (Requests::iterator itr = requests_.begin(); itr != requests_.end();) {
+        Requests::iterator next = itr;
+        ++next;
+        if (now - itr->second.accepted >= MAX_READING_TIME)
+            DropRequest(itr, TIMEOUT_RESPONSE);
+        else
+            oldest = min(oldest, itr->second.accepted);
+        itr = next;
+    }
+    if (requests_.empty())
+        return timeout;
+    int rest = static_cast<int>(oldest + MAX_READING_TIME - now);
+    return timeout == -1 || timeout > rest ? rest : timeout;
+}
+
+
+void Master::StartOutput(int conn_fd, const string& data)
+{
+    int ret = fcntl(conn_fd, F_SETFL, fcntl(conn_fd, F_GETFL) | O_NONBLOCK);
+    AK_ASSERT_EQUAL(ret, 0);
+    Output& output(outputs_[conn_fd]);
+    output.started = GetTime();
+    output.data = data;
+    output.sent = 0;
+    output_size_ += data.size();
+    Watch(EPOLL_CTL_ADD, conn_fd, EPOLLOUT);
+    while (!outputs_.empty() &&
+           (outputs_.size() > max_output_count_ ||
+            output_size_ > MAX_OUTPUT_SIZE)) {
+        Outputs::iterator oldest = outputs_.begin();
+        for (Outputs::iterator itr = outputs_.begin();
+             itr != outputs_.end();
+             ++itr)
+            if (itr->second.started < oldest->second.started)
+                oldest = itr;
+        cerr << "Too many offloaded responses, dropping the oldest\n";
+        DropOutput(oldest);
+    }
+}
+
+
+void Master::WriteOutput(Outputs::iterator itr)
+{
+    Output& output(itr->second);
+    ssize_t count = send(itr->first,
+                         output.data.data() + output.sent,
+                         output.data.size() - output.sent,
+                         MSG_NOSIGNAL);
+    if (count == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (count > 0)
+        output.sent += count;
+    if (count <= 0 || output.sent == output.data.size())
+        DropOutput(itr);
+}
+
+
+void Master::DropOutput(Outputs::iterator itr)
+{
+    int conn_fd = itr->first;
+    output_size_ -= itr->second.data.size();
+    outputs_.erase(itr);
+    Watch(EPOLL_CTL_DEL, conn_fd, 0);
+    close(conn_fd);
+}
+
+
+int Master::ExpireOutputs(int timeout)
+{
+    long long now = GetTime();
+    long long oldest = now;
+    for (Outputs::iterator itr = outputs_.begin(); itr != outputs_.end();) {
+        Outputs::iterator next = itr;
+        ++next;
+        if (now - itr->second.started >= MAX_WRITING_TIME)
+            DropOutput(itr);
+        else
+            oldest = min(oldest, itr->second.started);
+        itr = next;
+    }
+    if (outputs_.empty())
+        return timeout;
+    int rest = static_cast<int>(oldest + MAX_WRITING_TIME - now);
+    return timeout == -1 || timeout > rest ? rest : timeout;
+}
+
+
+void Master::DelayRelaunch(size_t idx)
+{
+    Close(workers_[idx]);
+    int delay = MIN_RELAUNCH_DELAY;
+    for (size_t i = 0; i < failure_counts_[idx] && delay < MAX_RELAUNCH_DELAY;
+         ++i)
+        delay *= 2;
+    delay = min(delay, MAX_RELAUNCH_DELAY);
+    ++failure_counts_[idx];
+    relaunch_times_[idx] = GetTime() + delay;
+    cerr << "Worker in slot " << idx << " exited before getting ready, "
+         << "relaunching in " << delay << " ms\n";
+}
+
+
+int Master::RelaunchFailed(int timeout)
+{
+    long long now = GetTime();
+    for (size_t idx = 0; idx < relaunch_times_.size(); ++idx) {
+        if (!relaunch_times_[idx])
+            continue;
+        if (now >= relaunch_times_[idx]) {
+            relaunch_times_[idx] = 0;
+            if (LaunchWorker(idx))
+                return -1;
+            continue;
+        }
+        int rest = static_cast<int>(relaunch_times_[idx] - now);
+        if (timeout == -1 || timeout > rest)
+            timeout = rest;
+    }
+    return timeout;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// API
+////////////////////////////////////////////////////////////////////////////////
+
+int ak::Serve(int& listen_fd, const ServeOptions& options)
+{
+    return Master(listen_fd, options).Run(listen_fd);
+}
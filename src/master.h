@@ -0,0 +1,106 @@
+// (c) 2011 by Anton Korenyushkin
+
+#ifndef MASTER_H
+#define MASTER_H
+
+#include "common.h"
+
+#include <sys/socket.h>
+#include <vector>
+
+
+// Linux supports SO_REUSEPORT since 3.9, older headers lack the constant
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+
+
+namespace ak
+{
+    // Worker reports that it has initialized or finished with a connection
+    const char READY_OP = 'R';
+
+    // Worker asks to be replaced after it has handled its connections
+    const char RECYCLE_OP = 'X';
+
+    // Worker passes a connection with the 4-byte size and the data to send
+    const char WRITE_OP = 'W';
+
+    // Worker that is about to exit passes back the connections it has not
+    // handled with their 4-byte count, each followed by the 4-byte size and
+    // the request data read from it by the master
+    const char RETURN_OP = 'N';
+
+    // Maximum number of connections passed to a worker in one message
+    const size_t MAX_BATCH_SIZE = 16;
+
+
+    class Scoreboard;
+
+
+    typedef std::vector<int> Cpus;
+
+
+    struct ServeOptions {
+        size_t worker_count;
+        size_t min_worker_count;
+        size_t max_worker_count;
+        size_t idle_time;
+        size_t max_pending_count;
+        size_t max_wait;
+        bool shed;
+        bool buffer_requests;
+        size_t max_header_size;
+        size_t max_body_size;
+        bool offload_writes;
+        size_t batch_size;
+        bool reuse_port;
+        Scoreboard* scoreboard_ptr;
+        Cpus cpus;
+        bool bind_memory;
+    };
+
+
+    // Accept connections on listen_fd and dispatch them to the least loaded
+    // workers, up to batch_size connections per worker.
+    // At most max_pending_count connections wait for a worker; with shed the
+    // rest are answered with 503 instead of being left in the backlog, and a
+    // nonzero max_wait in milliseconds bounds how long a connection waits.
+    // With buffer_requests the master reads each HTTP request completely
+    // within the size limits and passes it with the connection to a worker;
+    // at most a quarter of the descriptor limit are read at once.
+    // Out of descriptors the master leaves connections in the backlog until
+    // it frees some of its own or for a short delay.
+    // With offload_writes workers pass responses the clients are not ready
+    // to receive back with WRITE_OP and the master finishes sending them;
+    // beyond a quarter of the descriptor limit or 256 MB of responses the
+    // oldest ones are dropped.
+    // The master never blocks on writing to a worker, so workers may block
+    // on writing to the master.
+    // The pool starts with worker_count workers and grows up to
+    // max_worker_count under sustained load; workers idle for idle_time
+    // seconds are retired down to min_worker_count. A worker sending
+    // RECYCLE_OP is replaced by a new one and told to exit by closing its
+    // socket once it has handled the connections passed to it.
+    // SIGHUP makes the master launch a new generation of workers, which
+    // load the application code anew and replace the old ones as they get
+    // ready; the old workers finish their connections and exit.
+    // With reuse_port workers accept on their own: a TCP listen_fd must be
+    // bound with SO_REUSEPORT but not listening, each worker listens on its
+    // own socket bound to the same address; a unix socket is shared.
+    // A worker told to exit accepts the connections left in its queue
+    // before closing its socket. Connections completing the handshake in
+    // between are still reset unless the kernel migrates them to the other
+    // sockets (net.ipv4.tcp_migrate_req, Linux 5.14).
+    // The scoreboard slots of the workers are released once they have
+    // exited and been reaped.
+    // With nonempty cpus the worker in slot N is pinned to the CPU
+    // cpus[N % cpus.size()]; with bind_memory its memory is also bound to
+    // the NUMA node of that CPU. Placements are reported to stderr.
+    // Never returns in the master; in a forked worker returns the descriptor
+    // connecting it with the master and sets listen_fd to the socket the
+    // worker should accept on or to -1.
+    int Serve(int& listen_fd, const ServeOptions& options);
+}
+
+#endif // MASTER_H
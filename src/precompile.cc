@@ -0,0 +1,82 @@
+// (c) 2011 by Anton Korenyushkin
+
+// Build tool printing the header with V8 preparse data of init.js and the
+// lib modules. Usage: precompile INIT_JS [MODULE_JS...] > precompiled.h
+
+#include "js-script.h"
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <string>
+
+
+using namespace std;
+using namespace v8;
+
+
+namespace
+{
+    bool ReadFile(const char* path, string& data)
+    {
+        ifstream file(path, ios::binary);
+        if (!file.is_open())
+            return false;
+        data.assign(istreambuf_iterator<char>(file),
+                    istreambuf_iterator<char>());
+        return true;
+    }
+
+
+    void PrintData(size_t idx, const char* data, int size)
+    {
+        cout << "const unsigned char PRECOMPILED_" << idx << "[] = {";
+        for (int i = 0; i < size; ++i) {
+            if (i % 12 == 0)
+                cout << "\n   ";
+            cout << " 0x" << hex << setw(2) << setfill('0')
+                 << static_cast<unsigned>(static_cast<unsigned char>(data[i]))
+                 << dec << ',';
+        }
+        cout << "\n};\n\n";
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " INIT_JS [MODULE_JS...]\n";
+        return 1;
+    }
+    V8::Initialize();
+    cout << "namespace\n{\n";
+    string entries;
+    for (int i = 1; i < argc; ++i) {
+        string source;
+        if (!ReadFile(argv[i], source)) {
+            cerr << "Failed to read " << argv[i] << '\n';
+            return 1;
+        }
+        // Only init.js is compiled as is
+        if (i > 1)
+            source = MODULE_HEAD + source + MODULE_TAIL;
+        auto_ptr<ScriptData> script_data_ptr(
+            ScriptData::PreCompile(source.data(), source.size()));
+        if (script_data_ptr->HasError()) {
+            cerr << "Failed to precompile " << argv[i] << '\n';
+            return 1;
+        }
+        PrintData(i, script_data_ptr->Data(), script_data_ptr->Length());
+        ostringstream oss;
+        oss << "    {\"" << ak::HashSource(source.data(), source.size())
+            << "\", " << source.size() << ", PRECOMPILED_" << i << ", "
+            << script_data_ptr->Length() << "}, // " << argv[i] << '\n';
+        entries += oss.str();
+    }
+    cout << "const Precompiled PRECOMPILED[] = {\n" << entries << "};\n}\n";
+    return 0;
+}
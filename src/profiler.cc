@@ -0,0 +1,142 @@
+// (c) 2011 by Anton Korenyushkin
+
+#include "profiler.h"
+#include "common.h"
+
+#include <v8-profiler.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <map>
+#include <sstream>
+#include <string.h>
+
+
+using namespace std;
+using namespace ak;
+using namespace v8;
+
+
+namespace
+{
+    const int MAX_STACK_DEPTH = 64;
+    const char* PROFILE_TITLE = "patsak";
+
+
+    typedef map<string, int64_t> Stacks;
+
+
+    bool profiling = false;
+    Stacks native_stacks;
+
+
+    // Frames from the V8 profile and from stack traces must look the same
+    string GetFrameName(Handle<String> function_name,
+                        Handle<v8::Value> script_name)
+    {
+        string result(*String::Utf8Value(function_name));
+        if (result.empty())
+            result = "(anonymous)";
+        if (!script_name.IsEmpty() && script_name->IsString())
+            result += string(" (") + *String::Utf8Value(script_name) + ')';
+        // Semicolons separate frames in the collapsed format
+        for (size_t i = 0; i < result.size(); ++i)
+            if (result[i] == ';')
+                result[i] = ':';
+        return result;
+    }
+
+
+    void CollectStacks(const CpuProfileNode* node_ptr,
+                       const string& prefix,
+                       Stacks& stacks)
+    {
+        string stack(prefix);
+        if (!stack.empty())
+            stack += ';';
+        stack += GetFrameName(node_ptr->GetFunctionName(),
+                              node_ptr->GetScriptResourceName());
+        int64_t time = static_cast<int64_t>(node_ptr->GetSelfTime() * 1000);
+        if (time > 0)
+            stacks[stack] += time;
+        for (int i = 0; i < node_ptr->GetChildrenCount(); ++i)
+            CollectStacks(node_ptr->GetChild(i), stack, stacks);
+    }
+}
+
+
+void ak::StartProfiling()
+{
+    if (profiling)
+        return;
+    HandleScope handle_scope;
+    CpuProfiler::StartProfiling(String::New(PROFILE_TITLE));
+    profiling = true;
+}
+
+
+bool ak::IsProfiling()
+{
+    return profiling;
+}
+
+
+void ak::StopProfiling(const string& path)
+{
+    if (!profiling)
+        return;
+    profiling = false;
+    HandleScope handle_scope;
+    const CpuProfile* profile_ptr =
+        CpuProfiler::StopProfiling(String::New(PROFILE_TITLE));
+    Stacks stacks;
+    if (profile_ptr) {
+        const CpuProfileNode* root_ptr = profile_ptr->GetTopDownRoot();
+        for (int i = 0; i < root_ptr->GetChildrenCount(); ++i)
+            CollectStacks(root_ptr->GetChild(i), "", stacks);
+        CpuProfiler::DeleteAllProfiles();
+    }
+    // V8 charges native time to the calling JS frame
+    BOOST_FOREACH(const Stacks::value_type& value, native_stacks) {
+        stacks[value.first] += value.second;
+        size_t idx = value.first.rfind(';');
+        if (idx != string::npos) {
+            Stacks::iterator itr = stacks.find(value.first.substr(0, idx));
+            if (itr != stacks.end())
+                itr->second = max<int64_t>(itr->second - value.second, 0);
+        }
+    }
+    native_stacks.clear();
+    ostringstream oss;
+    BOOST_FOREACH(const Stacks::value_type& value, stacks)
+        if (value.second > 0)
+            oss << value.first << ' ' << value.second << '\n';
+    string output(oss.str());
+    // One write keeps the stacks of workers sharing the file apart
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1 ||
+        write(fd, output.data(), output.size()) !=
+        static_cast<ssize_t>(output.size()))
+        cerr << "Failed to write profile: " << strerror(errno) << '\n';
+    if (fd != -1)
+        close(fd);
+}
+
+
+void ak::RecordNativeFrame(const char* name, uint64_t time)
+{
+    HandleScope handle_scope;
+    Handle<StackTrace> stack_trace(
+        StackTrace::CurrentStackTrace(
+            MAX_STACK_DEPTH,
+            static_cast<StackTrace::StackTraceOptions>(
+                StackTrace::kFunctionName | StackTrace::kScriptName)));
+    string stack;
+    for (int i = stack_trace->GetFrameCount() - 1; i >= 0; --i) {
+        Handle<StackFrame> frame(stack_trace->GetFrame(i));
+        stack += GetFrameName(frame->GetFunctionName(),
+                              frame->GetScriptName());
+        stack += ';';
+    }
+    native_stacks[stack + name] += time;
+}
@@ -0,0 +1,27 @@
+// (c) 2011 by Anton Korenyushkin
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+#include <string>
+
+
+namespace ak
+{
+    // Start sampling JS execution with the V8 CPU profiler
+    void StartProfiling();
+
+    bool IsProfiling();
+
+    // Stop sampling and append the stacks in the collapsed format of
+    // flame graph tools to the file at path; sample weights are in
+    // microseconds
+    void StopProfiling(const std::string& path);
+
+    // Account time spent in a native callback as a frame of its own on top
+    // of the current JS stack
+    void RecordNativeFrame(const char* name, uint64_t time);
+}
+
+#endif // PROFILER_H
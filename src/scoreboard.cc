@@ -0,0 +1,174 @@
+// (c) 2011 by Anton Korenyushkin
+
+#include "scoreboard.h"
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+using namespace std;
+using namespace ak;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Header
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    const char MAGIC[8] = {'p', 'a', 't', 's', 'a', 'k', 's', 'b'};
+
+    const size_t MAX_READ_ATTEMPTS = 1000;
+
+
+    struct FileHeader {
+        char magic[sizeof(MAGIC)];
+        uint64_t slot_count;
+    } __attribute__((aligned(64)));
+
+
+    size_t GetFileSize(size_t slot_count)
+    {
+        return sizeof(FileHeader) + slot_count * sizeof(ScoreboardSlot);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Scoreboard
+////////////////////////////////////////////////////////////////////////////////
+
+Scoreboard::Scoreboard(const string& path, size_t slot_count)
+    : size_(GetFileSize(slot_count))
+    , slot_count_(slot_count)
+{
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, size_))
+        Fail("Failed to create scoreboard: " + string(strerror(errno)));
+    addr_ = mmap(0, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr_ == MAP_FAILED)
+        Fail(strerror(errno));
+    close(fd);
+    FileHeader* header_ptr = static_cast<FileHeader*>(addr_);
+    header_ptr->slot_count = slot_count;
+    memcpy(header_ptr->magic, MAGIC, sizeof(MAGIC));
+    slots_ = reinterpret_cast<ScoreboardSlot*>(header_ptr + 1);
+}
+
+
+Scoreboard::~Scoreboard()
+{
+    munmap(addr_, size_);
+}
+
+
+ScoreboardSlot* Scoreboard::Acquire(pid_t pid)
+{
+    for (size_t i = 0; i < slot_count_; ++i) {
+        ScoreboardSlot& slot(slots_[i]);
+        if (__sync_bool_compare_and_swap(&slot.pid, 0, pid)) {
+            // A worker killed inside an update leaves the sequence odd
+            if (slot.sequence & 1)
+                ++slot.sequence;
+            ScoreboardUpdate update(slot);
+            slot.state = STARTING_STATE;
+            slot.request_start = 0;
+            slot.request_count = 0;
+            slot.heap_size = 0;
+            slot.external_size = 0;
+            slot.gc_count = 0;
+            slot.gc_time = 0;
+            slot.db_time = 0;
+            slot.translation_hits = 0;
+            slot.translation_misses = 0;
+            slot.last_error[0] = 0;
+            return &slot;
+        }
+    }
+    return 0;
+}
+
+
+void Scoreboard::Release(pid_t pid)
+{
+    for (size_t i = 0; i < slot_count_; ++i) {
+        if (slots_[i].pid == pid) {
+            ScoreboardUpdate update(slots_[i]);
+            slots_[i].pid = 0;
+            return;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ScoreboardUpdate
+////////////////////////////////////////////////////////////////////////////////
+
+ScoreboardUpdate::ScoreboardUpdate(ScoreboardSlot& slot)
+    : slot_(slot)
+{
+    ++slot_.sequence;
+    __sync_synchronize();
+}
+
+
+ScoreboardUpdate::~ScoreboardUpdate()
+{
+    __sync_synchronize();
+    ++slot_.sequence;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ReadScoreboard
+////////////////////////////////////////////////////////////////////////////////
+
+bool ak::ReadScoreboard(const string& path, ScoreboardSlots& slots)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    FileHeader header;
+    if (fstat(fd, &st) ||
+        static_cast<size_t>(st.st_size) < sizeof(FileHeader) ||
+        read(fd, &header, sizeof(FileHeader)) != sizeof(FileHeader) ||
+        memcmp(header.magic, MAGIC, sizeof(MAGIC)) ||
+        static_cast<size_t>(st.st_size) != GetFileSize(header.slot_count)) {
+        close(fd);
+        errno = EINVAL;
+        return false;
+    }
+    size_t size = st.st_size;
+    void* addr = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return false;
+    const volatile ScoreboardSlot* slot_ptr =
+        reinterpret_cast<const ScoreboardSlot*>(
+            static_cast<const FileHeader*>(addr) + 1);
+    slots.resize(header.slot_count);
+    for (size_t i = 0; i < slots.size(); ++i) {
+        size_t attempt = 0;
+        for (;;) {
+            uint32_t sequence = slot_ptr[i].sequence;
+            __sync_synchronize();
+            memcpy(&slots[i],
+                   const_cast<const ScoreboardSlot*>(slot_ptr + i),
+                   sizeof(ScoreboardSlot));
+            __sync_synchronize();
+            if (!(sequence & 1) && sequence == slot_ptr[i].sequence)
+                break;
+            // The writer may have died inside an update
+            if (++attempt == MAX_READ_ATTEMPTS) {
+                slots[i].state = INCONSISTENT_STATE;
+                slots[i].last_error[MAX_ERROR_SIZE - 1] = 0;
+                break;
+            }
+        }
+    }
+    munmap(addr, size);
+    return true;
+}
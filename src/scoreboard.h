@@ -0,0 +1,90 @@
+// (c) 2011 by Anton Korenyushkin
+
+#ifndef SCOREBOARD_H
+#define SCOREBOARD_H
+
+#include <boost/utility.hpp>
+
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+
+namespace ak
+{
+    // Worker states
+    const char STARTING_STATE = 'S';
+    const char IDLE_STATE     = 'I';
+    const char BUSY_STATE     = 'B';
+
+    // Set by ReadScoreboard on a slot it failed to copy consistently
+    const char INCONSISTENT_STATE = '?';
+
+    const size_t MAX_ERROR_SIZE = 80;
+
+
+    // Status of a worker written by itself and read by other processes.
+    // Writers must use ScoreboardUpdate; readers check sequence to get
+    // a consistent copy without stopping the writer. A slot has a single
+    // writer at a time: the worker owning it until the worker has exited,
+    // then the master releasing it and the next worker acquiring it.
+    struct ScoreboardSlot {
+        uint32_t sequence;
+        int32_t pid;
+        char state;
+        char padding[7];
+        int64_t request_start; // ms since the epoch, 0 if idle
+        uint64_t request_count;
+        uint64_t heap_size;
+        uint64_t external_size;
+        uint64_t gc_count;
+        uint64_t gc_time; // microseconds
+        uint64_t db_time; // microseconds
+        uint64_t translation_hits;
+        uint64_t translation_misses;
+        char last_error[MAX_ERROR_SIZE];
+    } __attribute__((aligned(64)));
+
+
+    typedef std::vector<ScoreboardSlot> ScoreboardSlots;
+
+
+    // File backed scoreboard shared by the master and the forked workers
+    class Scoreboard : private boost::noncopyable {
+    public:
+        Scoreboard(const std::string& path, size_t slot_count);
+        ~Scoreboard();
+
+        // Take a free slot for the process, return 0 if there is none
+        ScoreboardSlot* Acquire(pid_t pid);
+
+        // Free the slot of the process if it has one; the process must have
+        // exited
+        void Release(pid_t pid);
+
+    private:
+        void* addr_;
+        size_t size_;
+        size_t slot_count_;
+        ScoreboardSlot* slots_;
+    };
+
+
+    class ScoreboardUpdate : private boost::noncopyable {
+    public:
+        ScoreboardUpdate(ScoreboardSlot& slot);
+        ~ScoreboardUpdate();
+
+    private:
+        ScoreboardSlot& slot_;
+    };
+
+
+    // Copy the slots of the scoreboard at path; return false on errors.
+    // A slot that stays in an update is copied as is and marked with
+    // INCONSISTENT_STATE.
+    bool ReadScoreboard(const std::string& path, ScoreboardSlots& slots);
+}
+
+#endif // SCOREBOARD_H
@@ -5,6 +5,9 @@
 
 #include <boost/lexical_cast.hpp>
 
+#include <list>
+#include <map>
+
 
 using namespace std;
 using namespace ak;
@@ -38,6 +41,35 @@ namespace
     }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Slot and Bindings
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    // Origin of a statement parameter: a position in one of the two
+    // draft lists of a translation and the type required from it
+    struct Slot {
+        size_t list_idx;
+        size_t pos;
+        Type type;
+        string pg_type;
+
+        Slot(size_t list_idx, size_t pos, Type type, const string& pg_type)
+            : list_idx(list_idx), pos(pos), type(type), pg_type(pg_type) {}
+    };
+
+
+    typedef vector<Slot> Slots;
+
+
+    // Statement parameters collected during a translation
+    struct Bindings {
+        Values values;
+        Slots slots;
+    };
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Control, RelTranslator, and ExprTranslator declarations
 ////////////////////////////////////////////////////////////////////////////////
@@ -85,7 +117,7 @@ namespace
             ostringstream os_;
         };
 
-        Control(const Drafts& params);
+        Control(const Drafts& params, size_t list_idx, Bindings& bindings);
 
         const Header& LookupBind(const RangeVar& rv) const;
         Header TranslateRel(const Rel& rel);
@@ -103,6 +135,8 @@ namespace
         typedef vector<BindData> BindStack;
 
         const Drafts& params_;
+        size_t list_idx_;
+        Bindings& bindings_;
         BindStack bind_stack_;
         ostream* os_ptr_;
     };
@@ -145,8 +179,10 @@ namespace
 // Control definitons
 ////////////////////////////////////////////////////////////////////////////////
 
-Control::Control(const Drafts& params)
+Control::Control(const Drafts& params, size_t list_idx, Bindings& bindings)
     : params_(params)
+    , list_idx_(list_idx)
+    , bindings_(bindings)
     , os_ptr_(0)
 {
 }
@@ -200,7 +236,10 @@ Type Control::PrintParam(size_t pos, Type needed_type)
             Error::QUERY,
             "Position " + lexical_cast<string>(pos) + " is out of range");
     Value value(params_[pos - 1].Get(needed_type));
-    *this << value;
+    string pg_type(value.GetPgType());
+    bindings_.values.push_back(value);
+    bindings_.slots.push_back(Slot(list_idx_, pos, needed_type, pg_type));
+    *this << '$' << bindings_.values.size() << "::" << pg_type;
     return value.GetType();
 }
 
@@ -850,6 +889,98 @@ Header RelTranslator::operator()(const Union& un) const
     return left_header;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Translation cache
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    const size_t MAX_TRANSLATION_COUNT = 512;
+
+
+    // Translation reusable with other parameter values of the same types
+    struct Translation {
+        string sql;
+        Header header;
+        Slots slots;
+    };
+
+
+    // Most recently used first
+    typedef list<pair<string, Translation> > TranslationList;
+    typedef map<string, TranslationList::iterator> TranslationMap;
+
+    TranslationList translation_list;
+    TranslationMap translation_map;
+    TranslationStats translation_stats = {0, 0};
+
+
+    // Values of the parameters for a cached translation.
+    // Fails if a value does not have the type it had when translated.
+    bool Rebind(const Translation& translation,
+                const Drafts& first_params,
+                const Drafts& second_params,
+                Values& values)
+    {
+        values.reserve(translation.slots.size());
+        BOOST_FOREACH(const Slot& slot, translation.slots) {
+            const Drafts& params(slot.list_idx ? second_params : first_params);
+            if (slot.pos > params.size())
+                return false;
+            Value value(params[slot.pos - 1].Get(slot.type));
+            if (value.GetPgType() != slot.pg_type)
+                return false;
+            values.push_back(value);
+        }
+        return true;
+    }
+
+
+    const Translation* FindTranslation(const string& key,
+                                       const Drafts& first_params,
+                                       const Drafts& second_params,
+                                       Values& values)
+    {
+        TranslationMap::iterator itr(translation_map.find(key));
+        if (itr == translation_map.end())
+            return 0;
+        const Translation& translation(itr->second->second);
+        if (!Rebind(translation, first_params, second_params, values)) {
+            values.clear();
+            return 0;
+        }
+        translation_list.splice(
+            translation_list.begin(), translation_list, itr->second);
+        ++translation_stats.hit_count;
+        return &translation;
+    }
+
+
+    const Translation& AddTranslation(const string& key,
+                                      const Translation& translation)
+    {
+        ++translation_stats.miss_count;
+        TranslationMap::iterator itr(translation_map.find(key));
+        if (itr != translation_map.end()) {
+            translation_list.erase(itr->second);
+            translation_map.erase(itr);
+        } else if (translation_map.size() == MAX_TRANSLATION_COUNT) {
+            translation_map.erase(translation_list.back().first);
+            translation_list.pop_back();
+        }
+        translation_list.push_front(make_pair(key, translation));
+        translation_map[key] = translation_list.begin();
+        return translation_list.front().second;
+    }
+
+
+    void AddKeyPart(string& key, const string& part)
+    {
+        key += part;
+        key += '\0';
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // API
 ////////////////////////////////////////////////////////////////////////////////
@@ -858,9 +989,11 @@ namespace
 {
     string DoTranslateQuery(const string& query,
                             const Drafts& params,
+                            size_t list_idx,
+                            Bindings& bindings,
                             Header* header_ptr = 0)
     {
-        Control control(params);
+        Control control(params, list_idx, bindings);
         Rel rel(ParseRel(query));
         string result;
         Control::StringScope string_scope(control, result);
@@ -875,9 +1008,11 @@ namespace
                            const Header& base_header,
                            const string& expr_str,
                            const Drafts& params,
+                           size_t list_idx,
+                           Bindings& bindings,
                            Type required_type = Type::DUMMY)
     {
-        Control control(params);
+        Control control(params, list_idx, bindings);
         Expr expr(ParseExpr(expr_str));
         RangeVar rv(base_name, Base(base_name));
         Control::BindData bind_data;
@@ -890,82 +1025,167 @@ namespace
         }
         return result;
     }
+
+
+    const Translation& Remember(const string& key,
+                                Translation& translation,
+                                Bindings& bindings,
+                                Statement& statement)
+    {
+        translation.slots.swap(bindings.slots);
+        statement.params.swap(bindings.values);
+        return AddTranslation(key, translation);
+    }
 }
 
 
-string ak::TranslateQuery(Header& header,
-                          const string& query,
-                          const Drafts& query_params,
-                          const Strings& by_exprs,
-                          const Drafts& by_params,
-                          size_t start,
-                          size_t length)
-{
-    ostringstream oss;
-    if (!by_exprs.empty())
-        oss << "SELECT * FROM (";
-    oss << DoTranslateQuery(query, query_params, &header);
-    if (!by_exprs.empty()) {
-        oss << ") AS \"" << THIS_NAME << "\" ORDER BY ";
-        Separator sep;
-        BOOST_FOREACH(const string& by_expr, by_exprs)
-            oss << sep
-                << DoTranslateExpr(THIS_NAME, header, by_expr, by_params);
+Statement ak::TranslateQuery(Header& header,
+                             const string& query,
+                             const Drafts& query_params,
+                             const Strings& by_exprs,
+                             const Drafts& by_params,
+                             size_t start,
+                             size_t length)
+{
+    SpanTimer timer(TRANSLATION_SPAN);
+    string key("query");
+    AddKeyPart(key, query);
+    BOOST_FOREACH(const string& by_expr, by_exprs)
+        AddKeyPart(key, by_expr);
+    Statement result;
+    const Translation* translation_ptr =
+        FindTranslation(key, query_params, by_params, result.params);
+    if (!translation_ptr) {
+        Translation translation;
+        Bindings bindings;
+        ostringstream oss;
+        if (!by_exprs.empty())
+            oss << "SELECT * FROM (";
+        oss << DoTranslateQuery(
+            query, query_params, 0, bindings, &translation.header);
+        if (!by_exprs.empty()) {
+            oss << ") AS \"" << THIS_NAME << "\" ORDER BY ";
+            Separator sep;
+            BOOST_FOREACH(const string& by_expr, by_exprs)
+                oss << sep
+                    << DoTranslateExpr(THIS_NAME,
+                                       translation.header,
+                                       by_expr,
+                                       by_params,
+                                       1,
+                                       bindings);
+        }
+        translation.sql = oss.str();
+        translation_ptr = &Remember(key, translation, bindings, result);
     }
+    // Literal bounds let the planner take them into account
+    result.sql = translation_ptr->sql;
     if (length != MINUS_ONE)
-        oss << " LIMIT " << length;
+        result.sql += " LIMIT " + lexical_cast<string>(length);
     if (start)
-        oss << " OFFSET " << start;
-    return oss.str();
+        result.sql += " OFFSET " + lexical_cast<string>(start);
+    header = translation_ptr->header;
+    return result;
 }
 
 
-string ak::TranslateCount(const string& query_str, const Drafts& params)
+Statement ak::TranslateCount(const string& query_str, const Drafts& params)
 {
-    return ("SELECT COUNT(*) FROM (" +
-            DoTranslateQuery(query_str, params) +
-            ") AS \"" + THIS_NAME + '"');
+    SpanTimer timer(TRANSLATION_SPAN);
+    string key("count");
+    AddKeyPart(key, query_str);
+    Statement result;
+    const Translation* translation_ptr =
+        FindTranslation(key, params, Drafts(), result.params);
+    if (!translation_ptr) {
+        Translation translation;
+        Bindings bindings;
+        translation.sql = ("SELECT COUNT(*) FROM (" +
+                           DoTranslateQuery(query_str, params, 0, bindings) +
+                           ") AS \"" + THIS_NAME + '"');
+        translation_ptr = &Remember(key, translation, bindings, result);
+    }
+    result.sql = translation_ptr->sql;
+    return result;
 }
 
 
-string ak::TranslateUpdate(const string& rel_var_name,
-                           const string& where,
-                           const Drafts& where_params,
-                           const StringMap& expr_map,
-                           const Drafts& update_params)
+Statement ak::TranslateUpdate(const string& rel_var_name,
+                              const string& where,
+                              const Drafts& where_params,
+                              const StringMap& expr_map,
+                              const Drafts& update_params)
 {
+    SpanTimer timer(TRANSLATION_SPAN);
     if (expr_map.empty())
         throw Error(Error::VALUE, "Empty update field set");
-    ostringstream oss;
-    oss << "UPDATE \"" << rel_var_name << "\" SET ";
-    const Header& header(get_header_cb(rel_var_name));
-    Separator sep;
-    BOOST_FOREACH(const NamedString& named_expr, expr_map)
-        oss << sep << '"' << named_expr.name << "\" = "
-            << DoTranslateExpr(rel_var_name,
-                               header,
-                               named_expr.str,
-                               update_params,
-                               GetAttr(header, named_expr.name).type);
-    oss << " WHERE " << DoTranslateExpr(rel_var_name,
-                                        header,
-                                        where,
-                                        where_params,
-                                        Type::BOOLEAN);
-    return oss.str();
+    string key("update");
+    AddKeyPart(key, rel_var_name);
+    AddKeyPart(key, where);
+    BOOST_FOREACH(const NamedString& named_expr, expr_map) {
+        AddKeyPart(key, named_expr.name);
+        AddKeyPart(key, named_expr.str);
+    }
+    Statement result;
+    const Translation* translation_ptr =
+        FindTranslation(key, update_params, where_params, result.params);
+    if (!translation_ptr) {
+        Translation translation;
+        Bindings bindings;
+        ostringstream oss;
+        oss << "UPDATE \"" << rel_var_name << "\" SET ";
+        const Header& header(get_header_cb(rel_var_name));
+        Separator sep;
+        BOOST_FOREACH(const NamedString& named_expr, expr_map)
+            oss << sep << '"' << named_expr.name << "\" = "
+                << DoTranslateExpr(rel_var_name,
+                                   header,
+                                   named_expr.str,
+                                   update_params,
+                                   0,
+                                   bindings,
+                                   GetAttr(header, named_expr.name).type);
+        oss << " WHERE " << DoTranslateExpr(rel_var_name,
+                                            header,
+                                            where,
+                                            where_params,
+                                            1,
+                                            bindings,
+                                            Type::BOOLEAN);
+        translation.sql = oss.str();
+        translation_ptr = &Remember(key, translation, bindings, result);
+    }
+    result.sql = translation_ptr->sql;
+    return result;
 }
 
 
-string ak::TranslateDelete(const string& rel_var_name,
-                           const string& where,
-                           const Drafts& params)
-{
-    return ("DELETE FROM \"" + rel_var_name + "\" WHERE " +
-            DoTranslateExpr(rel_var_name,
-                            get_header_cb(rel_var_name),
-                            where,
-                            params,
-                            Type::BOOLEAN));
+Statement ak::TranslateDelete(const string& rel_var_name,
+                              const string& where,
+                              const Drafts& params)
+{
+    SpanTimer timer(TRANSLATION_SPAN);
+    string key("delete");
+    AddKeyPart(key, rel_var_name);
+    AddKeyPart(key, where);
+    Statement result;
+    const Translation* translation_ptr =
+        FindTranslation(key, params, Drafts(), result.params);
+    if (!translation_ptr) {
+        Translation translation;
+        Bindings bindings;
+        translation.sql = ("DELETE FROM \"" + rel_var_name + "\" WHERE " +
+                           DoTranslateExpr(rel_var_name,
+                                           get_header_cb(rel_var_name),
+                                           where,
+                                           params,
+                                           0,
+                                           bindings,
+                                           Type::BOOLEAN));
+        translation_ptr = &Remember(key, translation, bindings, result);
+    }
+    result.sql = translation_ptr->sql;
+    return result;
 }
 
 
@@ -973,8 +1193,28 @@ string ak::TranslateExpr(const string& expr_str,
                          const string& rel_var_name,
                          const Header& rel_header)
 {
-    return DoTranslateExpr(
-        rel_var_name, rel_header, expr_str, Drafts(), Type::BOOLEAN);
+    SpanTimer timer(TRANSLATION_SPAN);
+    Bindings bindings;
+    return DoTranslateExpr(rel_var_name,
+                           rel_header,
+                           expr_str,
+                           Drafts(),
+                           0,
+                           bindings,
+                           Type::BOOLEAN);
+}
+
+
+void ak::ClearTranslations()
+{
+    translation_list.clear();
+    translation_map.clear();
+}
+
+
+TranslationStats ak::GetTranslationStats()
+{
+    return translation_stats;
 }
 
 
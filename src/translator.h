@@ -33,32 +33,53 @@ namespace ak
     }
 
 
-    std::string TranslateQuery(Header& header,
-                               const std::string& query,
-                               const Drafts& query_params = Drafts(),
-                               const Strings& by_exprs = Strings(),
-                               const Drafts& by_params = Drafts(),
-                               size_t start = 0,
-                               size_t length = MINUS_ONE);
-
-    std::string TranslateCount(const std::string& query,
-                               const Drafts& params);
-
-    std::string TranslateUpdate(const std::string& rel_var_name,
-                                const std::string& where,
-                                const Drafts& where_params,
-                                const StringMap& expr_map,
-                                const Drafts& expr_params);
-
-    std::string TranslateDelete(const std::string& rel_var_name,
-                                const std::string& where,
-                                const Drafts& params);
+    // SQL with $n placeholders and the values bound to them
+    struct Statement {
+        std::string sql;
+        Values params;
+    };
+
+
+    Statement TranslateQuery(Header& header,
+                             const std::string& query,
+                             const Drafts& query_params = Drafts(),
+                             const Strings& by_exprs = Strings(),
+                             const Drafts& by_params = Drafts(),
+                             size_t start = 0,
+                             size_t length = MINUS_ONE);
+
+    Statement TranslateCount(const std::string& query,
+                             const Drafts& params);
+
+    Statement TranslateUpdate(const std::string& rel_var_name,
+                              const std::string& where,
+                              const Drafts& where_params,
+                              const StringMap& expr_map,
+                              const Drafts& expr_params);
+
+    Statement TranslateDelete(const std::string& rel_var_name,
+                              const std::string& where,
+                              const Drafts& params);
 
     std::string TranslateExpr(const std::string& expr,
                               const std::string& rel_var_name,
                               const Header& header);
 
 
+    // Translations are cached by the query text; a hit requires
+    // the parameters to have the same types as in the cached one
+    struct TranslationStats {
+        size_t hit_count;
+        size_t miss_count;
+    };
+
+
+    TranslationStats GetTranslationStats();
+
+    // Must be called whenever the schema may have changed
+    void ClearTranslations();
+
+
     typedef const Header& (*GetHeaderCallback)(const std::string& rel_var_name);
 
     typedef void (*FollowReferenceCallback)(const std::string& key_rel_var_name,
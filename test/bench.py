@@ -0,0 +1,100 @@
+#!/usr/bin/env python
+
+# (c) 2011 by Anton Korenyushkin
+
+import subprocess
+import socket
+import signal
+import time
+import sys
+
+
+CONFIG_PATH = 'test/config'
+EXE_PATH    = 'exe/'
+PORT        = 13440
+ROUND_COUNT = 20
+KILL_EXPR   = 's = "x"; while(1) s += s'
+ROW_COUNT   = 10000
+QUERY_EXPR  = '''
+var db = require("db");
+db.create("Bench", {n: "number", s: "string", b: "boolean", d: "date"});
+for (var i = 0; i < %(rows)d; ++i)
+  db.insert("Bench", {n: i, s: "s" + i, b: i %% 2 == 0, d: new Date(i)});
+var start = new Date();
+for (var i = 0; i < %(rounds)d; ++i)
+  db.query("Bench");
+var time = (new Date() - start) / %(rounds)d;
+db.rollback();
+time
+''' % {'rows': ROW_COUNT, 'rounds': ROUND_COUNT}
+
+
+def _talk(message):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    try:
+        sock.connect(('127.0.0.1', PORT))
+        sock.send(message)
+        sock.shutdown(socket.SHUT_WR)
+        return sock.recv(1024)
+    except socket.error:
+        return ''
+    finally:
+        sock.close()
+
+
+def _wait_ready():
+    start = time.time()
+    while _talk('"ready"') != 'ready':
+        time.sleep(0.001)
+    return time.time() - start
+
+
+def _bench(args):
+    process = subprocess.Popen(
+        [PATSAK_PATH, '--config', CONFIG_PATH, '--workers', '1'] + args +
+        ['serve', str(PORT)],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE)
+    process.stdout.readline()
+    startup = _wait_ready()
+    respawns = []
+    for i in range(ROUND_COUNT):
+        # Running out of memory kills the worker
+        _talk(KILL_EXPR)
+        respawns.append(_wait_ready())
+    process.send_signal(signal.SIGTERM)
+    process.wait()
+    return startup, sum(respawns) / len(respawns)
+
+
+def _bench_query():
+    process = subprocess.Popen(
+        [PATSAK_PATH, '--config', CONFIG_PATH, '--workers', '1',
+         'serve', str(PORT)],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE)
+    process.stdout.readline()
+    _wait_ready()
+    result = _talk(QUERY_EXPR)
+    process.send_signal(signal.SIGTERM)
+    process.wait()
+    return float(result)
+
+
+def main():
+    if len(sys.argv) != 2:
+        print 'Usage:', sys.argv[0], 'mode'
+        sys.exit(1)
+
+    global PATSAK_PATH
+    PATSAK_PATH = EXE_PATH + sys.argv[1] + '/patsak'
+    print '%-10s %12s %12s' % ('mode', 'startup, ms', 'respawn, ms')
+    for name, args in [('plain', []), ('zygote', ['--zygote'])]:
+        startup, respawn = _bench(args)
+        print '%-10s %12.1f %12.1f' % (name, startup * 1000, respawn * 1000)
+    print
+    print 'query of %d rows: %.1f ms' % (ROW_COUNT, _bench_query())
+
+
+if __name__ == '__main__':
+    main()
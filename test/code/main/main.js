@@ -510,6 +510,30 @@ var dbTestSuite1 = {
       [[['id', 0], ['age', 22]], [['id', 2], ['age', 23]]]);
   },
 
+  testQueryColumns: function () {
+    assertThrow(TypeError, "db.queryColumns()");
+    var columns = db.queryColumns('User[name, age, flooder]', [], ['age']);
+    assertEqual(keys(columns), ['name', 'age', 'flooder']);
+    assertEqual(columns.name, ['anton', 'den', 'marina']);
+    assertSame(columns.age.length, 3);
+    assertEqual(Array.prototype.slice.call(columns.age), [22, 23, 25]);
+    assertEqual(columns.flooder, [true, true, false]);
+    db.create('D', {d: 'date'});
+    var date = new Date(2009, 0, 15, 13, 27, 11, 481);
+    db.insert('D', {d: date});
+    assertSame(db.queryColumns('D').d[0], date.getTime());
+    assertSame(db.queryColumns('User where id < 0').age.length, 0);
+  },
+
+  testParams: function () {
+    var query = 'User where age < $';
+    assertSame(db.query(query, [23]).length, 1);
+    assertSame(db.query(query, [23.5]).length, 2);
+    assertSame(db.query(query, [23]).length, 1);
+    assertSame(db.query('User where id == $2', [0, 1]).length, 1);
+    assertThrow(QueryError, db.query, 'User where id == $2', [0]);
+  },
+
   testInsert: function () {
     assertThrow(TypeError, "db.insert('User')");
     assertThrow(TypeError, "db.insert('User', 15)");
@@ -945,6 +969,10 @@ var dbTestSuite2 = {
     assertSame(tuples[0].b + '', '\0\0\0');
     assertSame(tuples[1].b + '', 'hello');
     assertThrow(TypeError, db.query, "X where +b");
+    db.update('X', '!b', [], {b: '$'}, [new Binary([0, 92, 255])]);
+    tuples = db.query('X', [], 'b');
+    assertSame(tuples.length, 3);
+    assertEqual(Array.prototype.slice.call(tuples[1].b), [0, 92, 255]);
   }
 };
 
@@ -1647,7 +1675,16 @@ test = function () {
 
 
 exports.handle = function (socket) {
-  socket.write(eval(socket.read() + ''));
+  var data = socket.read() + '';
+  // Buffered serve mode passes HTTP requests, evaluate their bodies
+  if (/^POST /.test(data))
+    data = data.substr(data.indexOf('\r\n\r\n') + 4);
+  socket.write(eval(data));
+};
+
+
+exports.warmup = function () {
+  warmedUp = true;
 };
 
 
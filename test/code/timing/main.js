@@ -0,0 +1,12 @@
+// (c) 2011 by Anton Korenyushkin
+
+require('jsgi');
+
+
+exports.app = function (request) {
+  return {
+    status: 200,
+    headers: {'Content-Type': 'text/plain'},
+    body: ['ok']
+  };
+};
@@ -778,14 +778,38 @@ namespace
 
 namespace
 {
+    Value GetResultValue(const QueryResult& query_result,
+                         size_t tuple_idx,
+                         size_t attr_idx)
+    {
+        Type type(query_result.GetHeader()[attr_idx].type);
+        if (type.IsNumeric())
+            return Value(type, query_result.GetNumber(tuple_idx, attr_idx));
+        if (type == Type::BOOLEAN)
+            return Value(type, query_result.GetBoolean(tuple_idx, attr_idx));
+        if (type == Type::BINARY)
+            return Value(type, query_result.GetBinary(tuple_idx, attr_idx));
+        return Value(type,
+                     string(query_result.GetChars(tuple_idx, attr_idx),
+                            query_result.GetLength(tuple_idx, attr_idx)));
+    }
+
+
     Table DumpRel(const string& query)
     {
-        Header header;
-        vector<Values> tuples;
-        Query(header, tuples, query);
+        QueryResult query_result(Query(query));
+        const Header& header(query_result.GetHeader());
         Table result(header);
-        BOOST_FOREACH(const Values& values, tuples)
+        for (size_t tuple_idx = 0;
+             tuple_idx < query_result.GetSize();
+             ++tuple_idx) {
+            Values values;
+            values.reserve(header.size());
+            for (size_t attr_idx = 0; attr_idx < header.size(); ++attr_idx)
+                values.push_back(
+                    GetResultValue(query_result, tuple_idx, attr_idx));
             result.AddRow(values);
+        }
         return result;
     }
 
@@ -877,7 +901,7 @@ namespace
     string DoTranslateQuery(const string& query)
     {
         Header header;
-        return TranslateQuery(header, query);
+        return TranslateQuery(header, query).sql;
     }
 }
 
@@ -912,9 +936,13 @@ BOOST_AUTO_TEST_CASE(translator_test)
     params.push_back(CreateDraft(Value(Type::STRING, "anton")));
     params.push_back(CreateDraft(Value(Type::NUMBER, 23)));
     Header header;
+    Statement statement(TranslateQuery(header, "{name: $1, age: $2}", params));
     BOOST_CHECK_EQUAL(
-        TranslateQuery(header, "{name: $1, age: $2}", params),
-        "SELECT DISTINCT 'anton' AS \"name\", 23 AS \"age\"");
+        statement.sql,
+        "SELECT DISTINCT $1::text AS \"name\", $2::int8 AS \"age\"");
+    BOOST_REQUIRE_EQUAL(statement.params.size(), 2);
+    BOOST_CHECK(statement.params[0] == Value(Type::STRING, "anton"));
+    BOOST_CHECK(statement.params[1] == Value(Type::NUMBER, 23));
     BOOST_CHECK_EQUAL(header.size(), 2);
     BOOST_CHECK_EQUAL(header[0].name, "name");
     BOOST_CHECK(header[0].type == Type::STRING);
@@ -927,44 +955,67 @@ BOOST_AUTO_TEST_CASE(translator_test)
     Drafts by_params;
     by_params.push_back(CreateDraft(Value(Type::NUMBER, 42)));
     by_params.push_back(CreateDraft(Value(Type::STRING, "abc")));
+    statement = TranslateQuery(
+        header, "User", Drafts(), by_exprs, by_params, 3, 4);
     BOOST_CHECK_EQUAL(
-        TranslateQuery(header, "User", Drafts(), by_exprs, by_params, 3, 4),
+        statement.sql,
         "SELECT * FROM (SELECT DISTINCT \"User\".* FROM \"User\") AS \"@\" "
-        "ORDER BY (\"@\".\"id\" % 42), (\"@\".\"name\" || 'abc') "
+        "ORDER BY (\"@\".\"id\" % $1::int8), (\"@\".\"name\" || $2::text) "
         "LIMIT 4 OFFSET 3");
+    BOOST_REQUIRE_EQUAL(statement.params.size(), 2);
+    BOOST_CHECK(statement.params[0] == Value(Type::NUMBER, 42));
+    BOOST_CHECK(statement.params[1] == Value(Type::STRING, "abc"));
+    statement = TranslateQuery(
+        header, "User", Drafts(), Strings(), Drafts(), 5);
     BOOST_CHECK_EQUAL(
-        TranslateQuery(header, "User", Drafts(), Strings(), Drafts(), 5),
+        statement.sql,
         "SELECT DISTINCT \"User\".* FROM \"User\" OFFSET 5");
+    BOOST_CHECK(statement.params.empty());
+    statement = TranslateQuery(
+        header, "User", Drafts(), Strings(), Drafts(), 0, 6);
     BOOST_CHECK_EQUAL(
-        TranslateQuery(header, "User", Drafts(), Strings(), Drafts(), 0, 6),
+        statement.sql,
         "SELECT DISTINCT \"User\".* FROM \"User\" LIMIT 6");
+    BOOST_CHECK(statement.params.empty());
 
     params.clear();
     params.push_back(CreateDraft(Value(Type::NUMBER, 2)));
+    statement = TranslateCount("User where id % $ == 0", params);
     BOOST_CHECK_EQUAL(
-        TranslateCount("User where id % $ == 0", params),
+        statement.sql,
         "SELECT COUNT(*) FROM ("
         "SELECT DISTINCT \"User\".* "
         "FROM \"User\" "
-        "WHERE ((\"User\".\"id\" % 2) = 0)) AS \"@\"");
+        "WHERE ((\"User\".\"id\" % $1::int8) = 0)) AS \"@\"");
+    BOOST_REQUIRE_EQUAL(statement.params.size(), 1);
+    BOOST_CHECK(statement.params[0] == Value(Type::NUMBER, 2));
 
+    statement = TranslateDelete("User","id % $ == 0", params);
     BOOST_CHECK_EQUAL(
-        TranslateDelete("User","id % $ == 0", params),
-        "DELETE FROM \"User\" WHERE ((\"User\".\"id\" % 2) = 0)");
+        statement.sql,
+        "DELETE FROM \"User\" WHERE ((\"User\".\"id\" % $1::int8) = 0)");
+    BOOST_REQUIRE_EQUAL(statement.params.size(), 1);
+    BOOST_CHECK(statement.params[0] == Value(Type::NUMBER, 2));
 
     StringMap expr_map;
     expr_map.add(NamedString("flooder", "id == 0 || !flooder"));
     expr_map.add(NamedString("name", "name + id + $"));
     Drafts expr_params;
     expr_params.push_back(CreateDraft(Value(Type::STRING, "abc")));
+    statement = TranslateUpdate(
+        "User", "id % $ == 0", params, expr_map, expr_params);
     BOOST_CHECK_EQUAL(
-        TranslateUpdate("User", "id % $ == 0", params, expr_map, expr_params),
+        statement.sql,
         "UPDATE \"User\" SET "
         "\"flooder\" = "
         "((\"User\".\"id\" = 0) OR NOT \"User\".\"flooder\"), "
         "\"name\" = "
-        "((\"User\".\"name\" || ak.to_string(\"User\".\"id\")) || 'abc') "
-        "WHERE ((\"User\".\"id\" % 2) = 0)");
+        "((\"User\".\"name\" || ak.to_string(\"User\".\"id\")) || "
+        "$1::text) "
+        "WHERE ((\"User\".\"id\" % $2::int8) = 0)");
+    BOOST_REQUIRE_EQUAL(statement.params.size(), 2);
+    BOOST_CHECK(statement.params[0] == Value(Type::STRING, "abc"));
+    BOOST_CHECK(statement.params[1] == Value(Type::NUMBER, 2));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -13,6 +13,9 @@ import shutil
 import psycopg2
 import errno
 import signal
+import time
+import struct
+import ctypes
 
 
 DB_NAME     = 'test-patsak'
@@ -42,6 +45,101 @@ def _launch(args):
     return _popen([PATSAK_PATH, '--config', CONFIG_PATH] + args)
 
 
+def _wait_for(predicate, timeout=5):
+    deadline = time.time() + timeout
+    while not predicate():
+        if time.time() > deadline:
+            return False
+        time.sleep(0.01)
+    return True
+
+
+class _Server(object):
+    # Every server listens on a port of its own, so a server left over by
+    # a failed test never answers the next one
+    _next_port = PORT2 + 1
+
+    def __init__(self, args, scoreboard=False):
+        self.port = _Server._next_port
+        _Server._next_port += 1
+        self.scoreboard_path = None
+        if scoreboard:
+            self.scoreboard_path = '%s/scoreboard-%d' % (TMP_PATH, self.port)
+            args = ['--scoreboard', self.scoreboard_path] + args
+        self.process = _launch(args + ['serve', str(self.port)])
+        self.banner = self.process.stdout.readline()
+        self.process.stdout.readline()
+
+    def connect(self, timeout=None):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.settimeout(timeout)
+        sock.connect(('127.0.0.1', self.port))
+        return sock
+
+    def status(self):
+        # PID and STATE come first in a row
+        status = _popen([PATSAK_PATH, '--scoreboard', self.scoreboard_path,
+                         'status'])
+        lines = status.stdout.read().splitlines()
+        status.wait()
+        return [line.split() for line in lines[1:]]
+
+    def worker_pids(self):
+        pgrep = _popen(['pgrep', '-P', str(self.process.pid)])
+        result = [int(pid) for pid in pgrep.stdout.read().split()]
+        pgrep.wait()
+        return result
+
+    def stop(self):
+        self.process.send_signal(signal.SIGTERM)
+        return self.process.wait()
+
+
+class _IOVec(ctypes.Structure):
+    _fields_ = [('base', ctypes.c_char_p),
+                ('len', ctypes.c_size_t)]
+
+
+class _MsgHdr(ctypes.Structure):
+    _fields_ = [('name', ctypes.c_void_p),
+                ('namelen', ctypes.c_uint32),
+                ('iov', ctypes.POINTER(_IOVec)),
+                ('iovlen', ctypes.c_size_t),
+                ('control', ctypes.c_void_p),
+                ('controllen', ctypes.c_size_t),
+                ('flags', ctypes.c_int)]
+
+
+class _FdCMsgHdr(ctypes.Structure):
+    _fields_ = [('len', ctypes.c_size_t),
+                ('level', ctypes.c_int),
+                ('type', ctypes.c_int),
+                ('fd', ctypes.c_int),
+                ('pad', ctypes.c_int)]
+
+
+def _send_fd(sock, op, fd):
+    # The socket module of Python 2 has no sendmsg
+    SCM_RIGHTS = 1
+    iov = _IOVec(op, 1)
+    cmsg = _FdCMsgHdr(ctypes.sizeof(_FdCMsgHdr) - ctypes.sizeof(ctypes.c_int),
+                      socket.SOL_SOCKET, SCM_RIGHTS, fd, 0)
+    msg = _MsgHdr(None, 0, ctypes.pointer(iov), 1,
+                  ctypes.addressof(cmsg), ctypes.sizeof(cmsg), 0)
+    libc = ctypes.CDLL(None)
+    return libc.sendmsg(sock.fileno(), ctypes.byref(msg), 0) == 1
+
+
+def _recv_fully(sock, size):
+    data = ''
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        if not chunk:
+            break
+        data += chunk
+    return data
+
+
 class Test(unittest.TestCase):
     def testDatabase(self):
         self.assertEqual(_popen(TEST_PATSAK_PATH).wait(), 0)
@@ -63,6 +161,11 @@ class Test(unittest.TestCase):
         self._check_launch(['--background', 'serve', 'bad/path'])
         self._check_launch(['serve', 'bad:bad'], 1)
         self._check_launch(['serve', 'example.com:80'], 1)
+        self._check_launch(['--cpus', '3-1', 'serve'], 1)
+        self._check_launch(['--cpus', '0,x', 'serve'], 1)
+        self._check_launch(['--numa-bind', 'serve'], 1)
+        self._check_launch(['--idle-gc', 'bad', 'serve'], 1)
+        self._check_launch(['--pending', '0', 'serve'], 1)
         self._check_launch(['--log', 'bad/log', '--background', 'serve'], 1)
         self.assertEqual(
             _popen([PATSAK_PATH, '--config', 'bad/config', 'serve']).wait(), 1)
@@ -102,6 +205,17 @@ class Test(unittest.TestCase):
         self.assertEqual(process.stdout.read(), '42\n')
         self.assertEqual(process.wait(), 0)
 
+    def testCodeCache(self):
+        # Missing parents of the cache directory are created
+        shutil.rmtree(TMP_PATH + '/code-cache', True)
+        code_cache_path = TMP_PATH + '/code-cache/nested'
+        for i in range(2):
+            process = _launch(['--code-cache', code_cache_path,
+                               'eval', 'test()'])
+            self.assertEqual(process.stdout.read(), '0\n')
+            self.assertEqual(process.wait(), 0)
+            self.assert_(os.listdir(code_cache_path))
+
     def _talk(self, sock, message):
         sock.send(message)
         sock.shutdown(socket.SHUT_WR)
@@ -147,6 +261,390 @@ class Test(unittest.TestCase):
             process.stdout.readline(), 'Running at 127.0.0.1:8000\n')
         process.send_signal(signal.SIGTERM)
 
+    def testDispatch(self):
+        server = _Server([])
+        slow_sock = server.connect()
+        slow_sock.send('"slow"')
+        # Round-robin dispatch would give one of these to the busy worker
+        for i in range(6):
+            sock = server.connect(5)
+            self.assertEqual(self._talk(sock, '"fast"'), 'fast')
+        self.assertEqual(self._talk(slow_sock, ''), 'slow')
+        self.assertEqual(server.stop(), 0)
+
+    def testReusePort(self):
+        server = _Server(['--reuse-port'])
+        self.assertEqual(
+            server.banner, 'Running at 127.0.0.1:%d\n' % server.port)
+        for i in range(6):
+            sock = server.connect()
+            self.assertEqual(self._talk(sock, str(i)), str(i))
+        self.assertEqual(server.stop(), 0)
+        # The recycled worker accepts until its replacement is ready
+        server = _Server(['--reuse-port', '--workers', '1',
+                          '--max-requests', '2'])
+        for i in range(10):
+            sock = server.connect(5)
+            self.assert_(
+                int(self._talk(sock, 'this.n = (this.n || 0) + 1')) >= 1)
+        self.assertEqual(server.stop(), 0)
+
+    def testBatch(self):
+        server = _Server(['--batch', '4'])
+        socks = [server.connect() for i in range(12)]
+        for i, sock in enumerate(socks):
+            self.assertEqual(self._talk(sock, str(i)), str(i))
+        self.assertEqual(server.stop(), 0)
+
+    def testReturnConnections(self):
+        server = _Server(['--workers', '1', '--batch', '4'])
+        dead_sock = server.connect()
+        dead_sock.send('s = "x"; while(1) s += s')
+        dead_sock.shutdown(socket.SHUT_WR)
+        # These are queued behind the request that kills the worker
+        socks = [server.connect(5) for i in range(3)]
+        for i, sock in enumerate(socks):
+            self.assertEqual(self._talk(sock, str(i)), str(i))
+        self.assertEqual(dead_sock.recv(1024), '')
+        dead_sock.close()
+        self.assertEqual(server.stop(), 0)
+
+    def testScale(self):
+        server = _Server(['--workers', '1', '--max-workers', '2'])
+        slow_sock = server.connect()
+        slow_sock.send('"slow"')
+        # The only worker is busy, so the pool has to grow
+        sock = server.connect(5)
+        self.assertEqual(self._talk(sock, '"fast"'), 'fast')
+        self.assertEqual(self._talk(slow_sock, ''), 'slow')
+        self.assertEqual(server.stop(), 0)
+
+    def testZygote(self):
+        server = _Server(['--zygote'])
+        self.assertEqual(
+            server.banner, 'Running at 127.0.0.1:%d\n' % server.port)
+        for expr, result in [('s = "x"; while(1) s += s', ''),
+                             ('typeof db.list()', 'object'),
+                             ('typeof db.list()', 'object'),
+                             ('typeof db.list()', 'object')]:
+            sock = server.connect()
+            self.assertEqual(self._talk(sock, expr), result)
+        self.assertEqual(server.stop(), 0)
+
+    def testRecycle(self):
+        server = _Server(['--workers', '1', '--max-requests', '2'])
+        for result in ['1', '2', '1', '2', '1']:
+            sock = server.connect(5)
+            self.assertEqual(
+                self._talk(sock, 'this.n = (this.n || 0) + 1'), result)
+        self.assertEqual(server.stop(), 0)
+
+    def _check_reload(self, server):
+        sock = server.connect(5)
+        self.assertEqual(self._talk(sock, 'x = 42'), '42')
+        old_pid, = [int(row[0]) for row in server.status()]
+        server.process.send_signal(signal.SIGHUP)
+
+        def replaced():
+            sock = server.connect(5)
+            self.assert_(
+                self._talk(sock, 'typeof x') in ('number', 'undefined'))
+            rows = server.status()
+            return (len(rows) == 1 and
+                    int(rows[0][0]) != old_pid and
+                    rows[0][1] == 'idle')
+
+        self.assert_(_wait_for(replaced))
+        sock = server.connect(5)
+        self.assertEqual(self._talk(sock, 'typeof x'), 'undefined')
+        self.assertEqual(server.stop(), 0)
+
+    def testReload(self):
+        # The old worker serves until the new one gets ready
+        self._check_reload(_Server(['--workers', '1'], scoreboard=True))
+
+    def testWork(self):
+        # The worker signals SIGRTMIN to its parent after each connection
+        SIGRTMIN = 34
+        signal.signal(SIGRTMIN, signal.SIG_IGN)
+        server_sock, worker_sock = socket.socketpair()
+        process = subprocess.Popen(
+            [PATSAK_PATH, '--config', CONFIG_PATH, 'work'],
+            stdin=worker_sock,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE)
+        worker_sock.close()
+        sock, peer_sock = socket.socketpair()
+        sock.settimeout(5)
+        self.assert_(_send_fd(server_sock, 'P', peer_sock.fileno()))
+        peer_sock.close()
+
+        def frame(expr):
+            return struct.pack('>I', len(expr)) + expr
+
+        def receive_result():
+            header = _recv_fully(sock, 5)
+            self.assertEqual(len(header), 5)
+            size, = struct.unpack('>I', header[1:])
+            return header[0], _recv_fully(sock, size)
+
+        sock.sendall(frame('2 + 2'))
+        self.assertEqual(receive_result(), ('S', '4'))
+        sock.sendall(frame('throw42()'))
+        status, result = receive_result()
+        self.assertEqual(status, 'F')
+        self.assert_('Uncaught 42' in result)
+        # Pipelined expressions are answered in order on the connection
+        sock.sendall(frame('1') + frame('"x"') + frame('[1, 2]'))
+        self.assertEqual(receive_result(), ('S', '1'))
+        self.assertEqual(receive_result(), ('S', 'x'))
+        self.assertEqual(receive_result(), ('S', '1,2'))
+        # An expression spans several reads
+        sock.sendall(frame('"%s".length' % ('x' * 5000)))
+        self.assertEqual(receive_result(), ('S', '5000'))
+        sock.close()
+        server_sock.close()
+        self.assertEqual(process.wait(), 0)
+        signal.signal(SIGRTMIN, signal.SIG_DFL)
+
+    def testReloadReusePort(self):
+        # No connection is reset while the workers are replaced
+        self._check_reload(
+            _Server(['--reuse-port', '--workers', '1'], scoreboard=True))
+
+    def testShed(self):
+        server = _Server(['--workers', '1', '--pending', '1', '--shed'],
+                         scoreboard=True)
+        sock = server.connect()
+        self.assertEqual(self._talk(sock, '"ready"'), 'ready')
+        # The worker is busy with the first one, so the second one waits and
+        # the rest, accepted in order after it, are shed
+        socks = [server.connect(5)]
+        self.assert_(_wait_for(
+            lambda: [row[1] for row in server.status()] == ['busy']))
+        socks += [server.connect(5) for i in range(3)]
+        for sock in socks[2:]:
+            self.assert_(
+                sock.recv(1024).startswith('HTTP/1.0 503 Service Unavailable'))
+            sock.close()
+        self.assertEqual(self._talk(socks[0], '"first"'), 'first')
+        self.assertEqual(self._talk(socks[1], '"second"'), 'second')
+        self.assertEqual(server.stop(), 0)
+
+    def testBufferRequests(self):
+        server = _Server(['--workers', '1', '--buffer-requests',
+                          '--max-body', '100'])
+
+        def request(expr):
+            return 'POST / HTTP/1.0\r\nContent-Length: %d\r\n\r\n%s' % (
+                len(expr), expr)
+
+        slow_sock = server.connect()
+        slow_sock.send(request('"slow"')[:20])
+        # The only worker is not held by the slow client
+        for i in range(3):
+            sock = server.connect(5)
+            self.assertEqual(self._talk(sock, request(str(i))), str(i))
+        self.assertEqual(self._talk(slow_sock, request('"slow"')[20:]), 'slow')
+        sock = server.connect()
+        self.assert_(
+            self._talk(sock, request('1' * 101)).startswith('HTTP/1.0 413'))
+        self.assertEqual(server.stop(), 0)
+
+    def testOffloadWrites(self):
+        server = _Server(['--workers', '1', '--offload-writes'])
+        size = 4 * 1024 * 1024
+        slow_sock = server.connect()
+        slow_sock.send('new Array(%d).join("x")' % (size + 1))
+        slow_sock.shutdown(socket.SHUT_WR)
+        # The worker is free while the slow client is not reading
+        sock = server.connect(5)
+        self.assertEqual(self._talk(sock, '"fast"'), 'fast')
+        received = 0
+        while True:
+            chunk = slow_sock.recv(65536)
+            if not chunk:
+                break
+            received += len(chunk)
+        slow_sock.close()
+        self.assertEqual(received, size)
+        self.assertEqual(server.stop(), 0)
+
+    def testOffloadBufferedRequests(self):
+        # Large requests and responses cross on the worker socket
+        server = _Server(['--workers', '1', '--buffer-requests',
+                          '--offload-writes', '--max-body', '2000000'])
+        request_size = 1024 * 1024
+        response_size = 4 * 1024 * 1024
+        expr = '"%s" + new Array(%d).join("y")' % (
+            'x' * request_size, response_size + 1)
+        socks = []
+        for i in range(4):
+            sock = server.connect(10)
+            sock.sendall('POST / HTTP/1.0\r\nContent-Length: %d\r\n\r\n%s'
+                         % (len(expr), expr))
+            socks.append(sock)
+        for sock in socks:
+            received = 0
+            while True:
+                chunk = sock.recv(65536)
+                if not chunk:
+                    break
+                received += len(chunk)
+            sock.close()
+            self.assertEqual(received, request_size + response_size)
+        self.assertEqual(server.stop(), 0)
+
+    def testStatus(self):
+        server = _Server(['--workers', '2'], scoreboard=True)
+
+        def read_status():
+            time.sleep(0.1)
+            status = _popen([PATSAK_PATH, '--scoreboard',
+                             server.scoreboard_path, 'status'])
+            lines = status.stdout.read().splitlines()
+            self.assertEqual(status.wait(), 0)
+            self.assertEqual(len(lines), 3)
+            self.assert_('TR_HIT%' in lines[0])
+            return [line.split() for line in lines[1:]]
+
+        sock = server.connect()
+        self.assertEqual(self._talk(sock, '1'), '1')
+        rows = read_status()
+        self.assertEqual(sum(int(row[3]) for row in rows), 1)
+        self.assertEqual(sum(int(row[9]) for row in rows), 0)
+        # One of the two workers gets the same query twice
+        for i in range(3):
+            sock = server.connect()
+            self.assertEqual(self._talk(sock, 'db.query("{}").length'), '1')
+        rows = read_status()
+        self.assertEqual(sum(int(row[3]) for row in rows), 4)
+        self.assert_(max(int(row[9]) for row in rows) > 0)
+        self.assertEqual(server.stop(), 0)
+        self._check_launch(['--scoreboard', 'bad/path', 'status'], 1)
+
+    def testWarmup(self):
+        server = _Server(['--workers', '1', '--warmup'])
+        sock = server.connect()
+        self.assertEqual(self._talk(sock, 'typeof warmedUp'), 'boolean')
+        self.assertEqual(server.stop(), 0)
+        self._check_launch(['--warmup', 'eval', '1'], 1)
+
+    def testIdleGC(self):
+        server = _Server(['--workers', '1', '--idle-gc', 'full',
+                          '--request-log'])
+        for i in range(3):
+            sock = server.connect()
+            self.assertEqual(
+                self._talk(sock, 'new Array(100000).join("x").length'),
+                '99999')
+        self.assertEqual(server.stop(), 0)
+        log = server.process.stderr.read()
+        self.assertEqual(log.count('Request total_ms='), 3)
+        self.assertEqual(log.count(' external_kb='), 3)
+
+    def testCpus(self):
+        server = _Server(['--workers', '1', '--cpus', '0'])
+        # The worker places itself before it serves
+        sock = server.connect(5)
+        self.assertEqual(self._talk(sock, '1'), '1')
+        worker_pid, = server.worker_pids()
+        with open('/proc/%d/status' % worker_pid) as f:
+            self.assert_('Cpus_allowed_list:\t0\n' in f.read())
+        self.assertEqual(server.stop(), 0)
+        self.assert_('Worker %d in slot 0 runs on CPU 0\n' % worker_pid
+                     in server.process.stderr.read())
+
+    def testProfile(self):
+        profile_path = TMP_PATH + '/profile'
+        if os.path.exists(profile_path):
+            os.remove(profile_path)
+        server = _Server(['--workers', '1', '--profile', profile_path,
+                          '--profile-every', '2'], scoreboard=True)
+        for i in range(2):
+            sock = server.connect()
+            # The worker waits in a native receive meanwhile
+            self.assert_(_wait_for(
+                lambda: [row[1] for row in server.status()] == ['busy']))
+            self.assertEqual(
+                self._talk(sock,
+                           'for (var i = 0; i < 100000; ++i) Math.sqrt(i); i'),
+                '100000')
+        self.assertEqual(server.stop(), 0)
+        with open(profile_path) as f:
+            lines = f.read().splitlines()
+        self.assert_(lines)
+        stacks = []
+        for line in lines:
+            stack, weight = line.rsplit(' ', 1)
+            self.assert_(int(weight) > 0)
+            stacks.append(stack)
+        self.assert_(
+            [stack for stack in stacks
+             if stack.endswith('SocketBg::ReceiveCb')])
+        # A profile window is written when it ends while the worker is idle
+        os.remove(profile_path)
+        server = _Server(['--workers', '1', '--profile', profile_path,
+                          '--profile-window', '1'])
+        # The worker handles SIGUSR2 once it has served
+        sock = server.connect()
+        self.assertEqual(self._talk(sock, '"ready"'), 'ready')
+        worker_pid, = server.worker_pids()
+        os.kill(worker_pid, signal.SIGUSR2)
+
+        def signal_pending():
+            with open('/proc/%d/status' % worker_pid) as f:
+                for line in f:
+                    name, value = line.split(':', 1)
+                    if (name in ('SigPnd', 'ShdPnd') and
+                        int(value, 16) & 1 << signal.SIGUSR2 - 1):
+                        return True
+            return False
+
+        # The request starts the window once the signal is handled
+        self.assert_(_wait_for(lambda: not signal_pending()))
+        sock = server.connect()
+        self.assertEqual(self._talk(sock, '"profiled"'), 'profiled')
+        self.assert_(_wait_for(lambda: os.path.exists(profile_path)))
+        self.assertEqual(server.stop(), 0)
+
+    def testServerTiming(self):
+        server = _Server(['--workers', '1', '--server-timing'])
+        for expr, result in [('require("core").serverTiming', 'true'),
+                             ('typeof require("core").getRequestTiming().db',
+                              'number')]:
+            sock = server.connect()
+            self.assertEqual(self._talk(sock, expr), result)
+        self.assertEqual(server.stop(), 0)
+        # A JSGI app reports the split in the response header
+        server = _Server(['--workers', '1', '--server-timing',
+                          '--app', CODE_PATH + '/timing'])
+        sock = server.connect(5)
+        sock.sendall('GET / HTTP/1.0\r\n\r\n')
+        response = ''
+        while True:
+            chunk = sock.recv(1024)
+            if not chunk:
+                break
+            response += chunk
+        sock.close()
+        head, body = response.split('\r\n\r\n', 1)
+        lines = head.split('\r\n')
+        self.assertEqual(lines[0], 'HTTP/1.1 200')
+        self.assertEqual(body, 'ok')
+        timing_lines = [line for line in lines
+                        if line.startswith('Server-Timing: ')]
+        self.assertEqual(len(timing_lines), 1)
+        metrics = {}
+        for metric in timing_lines[0][len('Server-Timing: '):].split(', '):
+            name, dur = metric.split(';dur=')
+            metrics[name] = float(dur)
+        self.assertEqual(
+            sorted(metrics),
+            ['db', 'gc', 'js', 'socket', 'total', 'translation'])
+        self.assert_(all(dur >= 0 for dur in metrics.values()))
+        self.assertEqual(server.stop(), 0)
+
 
 def main():
     if len(sys.argv) != 2: